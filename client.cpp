@@ -15,10 +15,23 @@
 #include <stdint.h>
 #include <sys/stat.h>
 #include <math.h>
+#include <limits.h>
 #include <algorithm>
 #include <deque>
 #include <set>
 #include <tuple>
+#include <sys/uio.h>
+#include <stdio_ext.h>
+#include <linux/sock_diag.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <sys/sendfile.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
@@ -29,13 +42,31 @@ using namespace std;
  *	|opcode||sequence Number||data size||Checksum|
  *	  8bits       32bits      16 bits     16bits
  *	Opcode has some wasted bits, but easier to make it a byte on it's own.
- *	Opcode is: 	0x00 - File request, data is file path.
+ *	Opcode is: 	0x00 - File request, data is file path. Can be followed by a zero byte and byte ranges
+ *				to send instead of the whole file, each a 64 bit offset and 64 bit length.
+ *				The sequence number can ask for a priority: the low byte is the class plus one (0
+ *				leaves it to the server), the next byte the weight (0 for the default). The top 16
+ *				bits are the verification round, 0 at first and one more each time bad leaves are
+ *				asked for again.
  *			0x01 - File Sending, data is file data.
- *			Ox02 - ACK, data is sequence number of next packet that is expected.
+ *			Ox02 - ACK, data is sequence number of next packet that is expected, then 32 bits saying
+ *				how many packets from there the client has room for (receiver window).
  *			0x03 - Error, file does not exist. Data is empty, size is set to 0.
  *			0x04 - Error ACK, data is empty.
- *			0x05 - Done Sending File, data and size are empty
- *			0x06 - File Done ACK, data and size are empty.
+ *			0x05 - Done Sending File, data is the Merkle root of the data (64 bits) and the number
+ *				of leaves (32 bits). See the leaf hashing below. The sequence number is the round
+ *				from the request, a 0x05 from another round is dropped.
+ *			0x06 - File Done ACK, data and size are empty. The sequence number is the round again.
+ *			0x07 - Last packet of a small file, comes right after the data with the Merkle root (64
+ *				bits) as its data. It stands in for 0x05, the client's ACK of it ends the transfer, no 0x06.
+ *			0x08 - Zero Range, data is a 32 bit count. Stands for that many packets of all zeros
+ *				starting at the sequence number (holes in a sparse file, or zeros read from it).
+ *			0x09 - Local File, only over the local socket: data is the 64 bit file size and the file
+ *				descriptor is attached, the client copies the file itself.
+ *			0x0A - Manifest. From the client, asks for the leaf hashes from the sequence number on
+ *				(data is empty); the server answers with the same sequence number and as many of the
+ *				64 bit hashes as fit in a packet. Sent during the transfer for leaves the client has
+ *				written, and between 0x05 and 0x06 for the rest.
  *	Sequence Number is packet num. 32 bits are used to allow for large files being transferred.
  *	Data size: The size of the data section in bytes. For this project, goes up to 1024, but did 2 bytes
  *			for ease of implementation. 
@@ -50,8 +81,13 @@ typedef struct{
 	uint16_t check;
 }ratsHead;
 
+// Messages for every packet only come out with RATS_VERBOSE set: printing them costs more than
+// sending the packet does.
+bool verbose = false;
+
 struct packetData{
 	unsigned char data[1015];
+	uint32_t zeroRun; // Packets of zeros this stands for (from a 0x08), 0 for file data.
 };
 
 deque<tuple<int, struct packetData, size_t>> packetsRec; // deck of seq-num + packet data + packet size
@@ -62,6 +98,79 @@ bool notDone = true;
 int startWin = 0;
 int endWin = 4;
 
+// Most out-of-order packets held in packetsRec. Anything further ahead is dropped, the server is
+// told how much room is left in every ACK.
+#define REORDER_SLOTS 256
+
+// Byte ranges asked for, in the order the server sends them (see normalizeRanges). Empty for
+// a whole file. Data from the server is the ranges one after the other: each piece is written
+// at the offset it came from, or when streaming to stdout, just one after the other.
+struct byteRange{
+	off_t offset;
+	off_t length;
+};
+vector<struct byteRange> ranges;
+size_t curRange = 0; // Range being written
+off_t rangeLeft = 0; // Bytes of it not written yet
+bool streamOut = false;
+
+// Merkle tree over the data stream. The leaves are LEAF_PACKETS packets' worth of data each,
+// hashed with XXH64; a parent is the XXH64 of its two children's hashes, an odd one out moves up
+// as is. In-order data is gathered into leaves as it gets written and full leaves are hashed on
+// HASH_THREADS worker threads, so the file never has to be read back. The server's leaf hashes
+// are asked for while the data comes in, MANIFEST_LEAVES at a time, and each leaf is checked as
+// soon as both hashes are known; the rest are fetched after the 0x05. A leaf that doesn't match
+// the server's is fetched again as a byte range. Each time is a new round (verifyRound); rounds
+// that leave less to fetch are free, VERIFY_RETRIES counts the ones that don't.
+#define LEAF_PACKETS 16
+#define LEAF_BYTES (LEAF_PACKETS * 1015)
+#define HASH_THREADS 2
+#define VERIFY_RETRIES 3
+#define MANIFEST_LEAVES 126 // Leaf hashes in one 0x0A
+uint32_t verifyRound = 0;
+vector<uint64_t> leafHashes; // Guarded by hashLock
+vector<char> leafDone; // Whether each leaf is hashed yet, guarded by hashLock
+size_t leafCount = 0; // Leaves handed out so far
+vector<uint64_t> serverLeaves; // The server's leaf hashes we have, guarded by hashLock
+size_t leafChecked = 0; // Leaves compared with the server's so far
+size_t manifestAsked = SIZE_MAX; // First leaf of the last 0x0A sent during the transfer
+double manifestAt = 0; // and when
+vector<unsigned char> leafBuf; // Leaf being filled
+deque<pair<size_t, vector<unsigned char>>> hashJobs;
+size_t hashPending = 0;
+bool hashStop = false;
+mutex hashLock;
+condition_variable hashReady, hashDone;
+uint64_t zeroLeaf; // Hash of a whole leaf of zeros, holes don't need hashing
+vector<size_t> badLeaves; // Leaves that failed, in order, guarded by hashLock
+
+// Unix socket a server listens on for clients on the same host, by port. It is in the abstract
+// namespace (see localAddr).
+#define LOCAL_SOCKET "rats-%d"
+
+// Delayed ACKs. An ACK goes out once ackEvery in-order packets have been written or ACK_DELAY_MS
+// after the first one that is not ACKed yet, whichever comes first. ackEvery is half of what the
+// server can have in flight: the window we advertise, or less if the timer has shown its own
+// window is smaller. It starts high so the first ACK comes off the timer and measures that.
+#define ACK_DELAY_MS 10
+int ackEvery = REORDER_SLOTS;
+int unacked = 0; // In-order packets written since the last ACK
+int ackFlight = INT_MAX; // Server's window as the timer last saw it, INT_MAX if ours limits it
+uint32_t ackWindow = REORDER_SLOTS; // Window we advertised in the last ACK
+double ackDue = 0; // When the delayed ACK has to go out, 0 if none is pending
+int64_t lastSeq = -1; // Seq of the 0x07 packet once one has come, the file ends there
+uint64_t lastRoot = 0; // Root it carried
+
+// Batched I/O. Datagrams are pulled off the socket with one recvmmsg call and handed out one at a
+// time by recvPacket. Set RATS_IO=blocking to use the plain recvfrom path; it is also picked
+// automatically if the kernel does not have recvmmsg.
+#define MAX_BATCH 64
+int batchIO = 1;
+char batchBuf[MAX_BATCH][1024];
+int batchLen[MAX_BATCH];
+int batchCount = 0;
+int batchNext = 0;
+
 // Comparator function to organize packetsRec
 bool tupleCompare(tuple<int, struct packetData, size_t> first, tuple<int, struct packetData, size_t> second){
 	return get<0>(first) < get<0>(second);
@@ -83,6 +192,9 @@ uint16_t generateChecksum(char *buf, int size)
 		size -= 2;
 		place += 2;
 	}
+	// Odd trailing byte counts as if padded with a zero.
+	if(size == 1)
+		sum += place[0];
 	// More Carries
 	while (sum >> 16)
 		sum = (sum & 0xFFFF) + (sum >> 16);
@@ -96,170 +208,467 @@ uint16_t generateChecksum(char *buf, int size)
 // Return 1 if not valid, 0 if valid.
 int checkChecksum(char* buf, int size)
 {
-	// To check checksum, go thorugh size bytes of buf, adding as words. If end up with 0
-	// it is right.
-	
-	// Using generateChecksum function to check it. Assuming buf points to IP header, size is IP size.
-	// Assuming Checksum field was not cleared to 0 before.
+	// The checksum sits at an odd offset (byte 7), so summing the packet with it in place does
+	// not fold to 0. Instead clear the field, regenerate, and compare against what was sent.
+	if(size < 9)
+		return 1;
+
+	// Using generateChecksum function to check it. Assuming buf points to start of header.
+	uint16_t sent;
+	memcpy(&sent, buf + 7, 2);
+	memset(buf + 7, 0, 2);
 	uint16_t check = generateChecksum(buf, size);
-	
-	if(check == 0)
+	memcpy(buf + 7, &sent, 2);
+	if(check == sent)
 		return 0;
 	return 1;
 }
 
 
-// fileData writes data to file, needs the socket, serverAddr, File Pointer, and the remaining 3 parameters are if
-// the original packet needs to be resent.
-void fileData(int &sock, struct sockaddr_in &serverAddr, FILE* file, bool &first, char *oldPacket, uint16_t &size){
-	// check seq num of packet, copy it to our packetsRec deque.
-	char buf[1024];
-	socklen_t addrLen = sizeof(serverAddr);
-	for(int i = 0; i < 5; i++){ // Expecting 5 packets, loop five times, but only add to packetsRec if unique
-		int recLen = recvfrom(sock, buf, 1024, 0, (struct sockaddr *)&serverAddr, &addrLen);
-		// If timeout error and was the first send, send file request again.
-		if(errno == EAGAIN || errno == EWOULDBLOCK){
-			if(first){
-				int err = sendto(sock, oldPacket, (9 + size), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
-				if(err < 0){
-					perror("Error requesting file: timeout\n");
-				}
-				first = false;
-				return;
+// recvPacket returns the next datagram from the server in buf (1024 bytes), refilling the batch
+// when it runs out. Returns the datagram size, or -1 with errno set the same way as recvfrom.
+int recvPacket(int &sock, struct sockaddr_in &serverAddr, char *buf){
+	if(batchNext == batchCount){
+		batchNext = 0;
+		batchCount = 0;
+		if(batchIO){
+			struct mmsghdr msgs[MAX_BATCH];
+			struct iovec iovs[MAX_BATCH];
+			memset(msgs, 0, sizeof(msgs));
+			for(int i = 0; i < MAX_BATCH; i++){
+				iovs[i].iov_base = batchBuf[i];
+				iovs[i].iov_len = 1024;
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
 			}
+			// Blocks (up to SO_RCVTIMEO) for the first datagram, then takes whatever else is queued.
+			int n = recvmmsg(sock, msgs, MAX_BATCH, MSG_WAITFORONE, NULL);
+			if(n < 0 && errno != ENOSYS)
+				return -1;
+			if(n < 0) // No recvmmsg, stay on recvfrom from here on.
+				batchIO = 0;
+			for(int i = 0; i < n; i++)
+				batchLen[i] = msgs[i].msg_len;
+			batchCount = n > 0 ? n : 0;
 		}
-		first = false;
-		
-		ratsHead recHdr;
-		char *current = buf;
-		memcpy(&recHdr.opCode, current, 1);
-		current++;
-		memcpy(&recHdr.seqNum, current, 4);
-		current+= 4;
-		memcpy(&recHdr.size, current, 2);
-		current += 2;
-		memcpy(&recHdr.check, current, 2);
-		current += 2;
-
-		// Checksum. If bad, just drop.
-		if(checkChecksum(buf, recLen) == 0){
-			printf("Dropped packet: bad checksum seq is %d\n", recHdr.seqNum);
-			continue;
+		if(!batchIO){
+			socklen_t addrLen = sizeof(serverAddr);
+			return recvfrom(sock, buf, 1024, 0, (struct sockaddr *)&serverAddr, &addrLen);
 		}
+	}
+	memcpy(buf, batchBuf[batchNext], batchLen[batchNext]);
+	return batchLen[batchNext++];
+}
 
-		// If File Not Found error, ack back and close.
-		if(recHdr.opCode == 0x03){
-			printf("Got file does not exist packet\n");
-			char toSend[9];
-			char *sendCurrent = toSend;
-			ratsHead sendHdr;
-		
-			sendHdr.opCode = 0x04;
-			memcpy(sendCurrent, &sendHdr.opCode, 1);
-			sendCurrent++;
-		
-			sendHdr.seqNum = 0;
-			memcpy(sendCurrent, &sendHdr.seqNum, 4);
-			sendCurrent += 4;
-
-			sendHdr.size = 0;
-			memcpy(sendCurrent, &sendHdr.size, 2);
-			sendCurrent += 2;
-
-			sendHdr.check = 0;
-			memcpy(sendCurrent, &sendHdr.check, 2);
-
-			auto check = generateChecksum(toSend, 9);
-			sendHdr.check = check;
-			memcpy(sendCurrent, &sendHdr.check, 2);
-			printf("Sending file does not exist ACK\n");
-			int err = sendto(sock, toSend, 9, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
-			if(err<0){
-				perror("Error sending Error ACK\n");
+// How many packets past startWin we can take right now: free reorder slots, less the backlog
+// already waiting on the writer (datagrams pulled off the socket but not handled yet, and data
+// stdio has not handed to the disk). Also limited by free space in the socket receive buffer.
+uint32_t recvWindow(int &sock, FILE *file){
+	int room = REORDER_SLOTS - (int)packetsRec.size() - (batchCount - batchNext);
+	room -= __fpending(file) / (64 * 1015); // stdio flushes on its own, only a deep backlog counts
+#ifdef SO_MEMINFO
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t memLen = sizeof(mem);
+	if(getsockopt(sock, SOL_SOCKET, SO_MEMINFO, mem, &memLen) == 0){
+		// Each queued datagram costs about twice its size in kernel bookkeeping.
+		int sockRoom = ((int)mem[SK_MEMINFO_RCVBUF] - (int)mem[SK_MEMINFO_RMEM_ALLOC]) / (2 * 1024);
+		room = min(room, sockRoom);
+	}
+#endif
+	return room > 0 ? room : 0;
+}
+
+// Writes len zero bytes at the file's position without storing them, so the copy stays sparse:
+// punch a hole (in case there was data there already) and seek past it. Where that can't be
+// done, like on a pipe, the zeros are written out.
+void writeZeros(FILE *file, off_t len){
+	off_t pos = ftello(file);
+	struct stat status;
+	if(pos >= 0 && fflush(file) == 0 && fstat(fileno(file), &status) == 0 && S_ISREG(status.st_mode)){
+		// Past the end of the file there is nothing to clear.
+		if(pos >= status.st_size || fallocate(fileno(file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len) == 0){
+			if(fseeko(file, pos + len, SEEK_SET) == 0)
 				return;
-			}
-			notDone = false;
-			return;
 		}
+	}
+	static const char zeros[4096] = {0};
+	while(len > 0){
+		size_t part = min(len, (off_t)sizeof(zeros));
+		if(fwrite(zeros, 1, part, file) != part)
+			return;
+		len -= part;
+	}
+}
 
-		// If File done, ack back and return.
-		if(recHdr.opCode == 0x05){
-			printf("Got file done packet\n");
-			char toSend[9];
-			char *sendCurrent = toSend;
-			ratsHead sendHdr;
-		
-			sendHdr.opCode = 0x06;
-			memcpy(sendCurrent, &sendHdr.opCode, 1);
-			sendCurrent++;
-		
-			sendHdr.seqNum = 0;
-			memcpy(sendCurrent, &sendHdr.seqNum, 4);
-			sendCurrent += 4;
-
-			sendHdr.size = 0;
-			memcpy(sendCurrent, &sendHdr.size, 2);
-			sendCurrent += 2;
-
-			sendHdr.check = 0;
-			memcpy(sendCurrent, &sendHdr.check, 2);
-
-			auto check = generateChecksum(toSend, 9);
-			sendHdr.check = check;
-			memcpy(sendCurrent, &sendHdr.check, 2);
-			printf("Sending file done sending ACK\n");
-			int err = sendto(sock, toSend, 9, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
-			if(err<0){
-				perror("Error sending Error ACK\n");
-				return;
+bool rangeCompare(struct byteRange first, struct byteRange second){
+	return first.offset < second.offset;
+}
+
+// Puts ranges in order, merges ones that overlap or touch, and cuts them off at size. The server
+// does the same, so both agree on where each packet's bytes go. The client doesn't know the
+// size, but the server cutting ranges short only ends the data early.
+void normalizeRanges(vector<struct byteRange> &list, off_t size){
+	sort(list.begin(), list.end(), rangeCompare);
+	vector<struct byteRange> merged;
+	for(auto &e : list){
+		if(e.offset < 0 || e.length <= 0 || e.offset >= size)
+			continue;
+		off_t end = (e.length > size - e.offset) ? size : e.offset + e.length;
+		if(!merged.empty() && e.offset <= merged.back().offset + merged.back().length)
+			merged.back().length = max(merged.back().length, end - merged.back().offset);
+		else
+			merged.push_back({e.offset, end - e.offset});
+	}
+	list = merged;
+}
+
+// Reads "offset:length,offset:length" into ranges. A missing length means to the end of the file.
+void parseRanges(char *line){
+	for(char *part = strtok(line, ", \n"); part != NULL; part = strtok(NULL, ", \n")){
+		char *colon = strchr(part, ':');
+		struct byteRange e;
+		e.offset = strtoll(part, NULL, 10);
+		e.length = INT64_MAX;
+		if(colon != NULL && colon[1] != '\0')
+			e.length = strtoll(colon + 1, NULL, 10);
+		ranges.push_back(e);
+	}
+	normalizeRanges(ranges, INT64_MAX);
+}
+
+// Writes len bytes of the data stream (zeros if data is NULL) where they belong.
+void writeOut(FILE *file, unsigned char *data, off_t len){
+	while(len > 0){
+		off_t part = len;
+		if(!ranges.empty()){
+			while(rangeLeft == 0 && curRange + 1 < ranges.size()){
+				curRange++;
+				rangeLeft = ranges[curRange].length;
+				if(!streamOut)
+					fseeko(file, ranges[curRange].offset, SEEK_SET);
 			}
-			notDone = false;
-			if(packetsRec.size() == 0)
+			part = min(len, rangeLeft);
+			if(part == 0) // More than was asked for, nowhere to put it.
 				return;
+			rangeLeft -= part;
 		}
+		if(data != NULL){
+			fwrite(data, 1, part, file);
+			data += part;
+		}
+		else
+			writeZeros(file, part);
+		len -= part;
+	}
+}
 
-		uint32_t seq = recHdr.seqNum;
-		printf("Data packet: seq is %u\n", seq);
-	
-		struct packetData data;
-		memcpy(&data, current, recHdr.size);
+// Monotonic clock in seconds.
+double nowSec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// XXH64 hash, same as the server's.
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input){
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t val){
+	acc ^= xxhRound(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xxh64(const unsigned char *p, size_t len, uint64_t seed){
+	const unsigned char *end = p + len;
+	uint64_t h;
+	if(len >= 32){
+		uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+		uint64_t v2 = seed + PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME64_1;
+		uint64_t lane;
+		do{
+			memcpy(&lane, p, 8); v1 = xxhRound(v1, lane); p += 8;
+			memcpy(&lane, p, 8); v2 = xxhRound(v2, lane); p += 8;
+			memcpy(&lane, p, 8); v3 = xxhRound(v3, lane); p += 8;
+			memcpy(&lane, p, 8); v4 = xxhRound(v4, lane); p += 8;
+		}while(p + 32 <= end);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxhMerge(h, v1);
+		h = xxhMerge(h, v2);
+		h = xxhMerge(h, v3);
+		h = xxhMerge(h, v4);
+	}
+	else
+		h = seed + PRIME64_5;
+	h += len;
+	while(p + 8 <= end){
+		uint64_t lane;
+		memcpy(&lane, p, 8);
+		h ^= xxhRound(0, lane);
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if(p + 4 <= end){
+		uint32_t lane;
+		memcpy(&lane, p, 4);
+		h ^= (uint64_t)lane * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while(p < end){
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		p++;
+	}
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
 
-		// if this sequence has not yet been found, add packet info.
-		if(sequence.find(seq) == sequence.end()){
-			if(recHdr.size > 0){
-				packetsRec.push_back(make_tuple(seq, data, recHdr.size));
-				sequence.insert(seq);
+// Root of the Merkle tree over leaves.
+uint64_t merkleRoot(vector<uint64_t> level){
+	if(level.empty())
+		return xxh64(NULL, 0, 0);
+	while(level.size() > 1){
+		vector<uint64_t> up;
+		for(size_t i = 0; i < level.size(); i += 2){
+			if(i + 1 == level.size()){
+				up.push_back(level[i]);
+				break;
 			}
+			unsigned char pair[16];
+			memcpy(pair, &level[i], 8);
+			memcpy(pair + 8, &level[i + 1], 8);
+			up.push_back(xxh64(pair, 16, 0));
 		}
+		level = up;
 	}
-	sort(packetsRec.begin(), packetsRec.end(), tupleCompare);
+	return level[0];
+}
 
-	// If the lowest recieved packet is our start window, can write. Increment start and end win, pop.
-	while(get<0>(packetsRec.front()) == startWin){
-		//printf("Writing packet %d\n", get<0>(packetsRec.front()));
-		//printf("Packet size is %d\n", get<2>(packetsRec.front()));
-		fwrite(&get<1>(packetsRec.front()), get<2>(packetsRec.front()), 1, file);
-		startWin++;
-		endWin++;
-		packetsRec.pop_front();
+// Compares leaves with the server's, in order, as far as both hashes are known. Caller holds
+// hashLock.
+void checkLeaves(){
+	while(leafChecked < serverLeaves.size() && leafChecked < leafCount && leafDone[leafChecked]){
+		if(leafHashes[leafChecked] != serverLeaves[leafChecked]){
+			badLeaves.push_back(leafChecked);
+			if(verbose)
+				printf("Leaf %zu failed verification\n", leafChecked);
+		}
+		leafChecked++;
 	}
+}
 
-	uint32_t expected = 0;
+// Worker thread: hashes leaves as they are handed out.
+void hashWorker(){
+	unique_lock<mutex> lock(hashLock);
+	while(1){
+		hashReady.wait(lock, []{ return hashStop || !hashJobs.empty(); });
+		if(hashJobs.empty())
+			return;
+		auto job = move(hashJobs.front());
+		hashJobs.pop_front();
+		lock.unlock();
+		uint64_t h = xxh64(job.second.data(), job.second.size(), 0);
+		lock.lock();
+		leafHashes[job.first] = h;
+		leafDone[job.first] = 1;
+		checkLeaves();
+		hashPending--;
+		hashDone.notify_all();
+	}
+}
+
+// Hands the leaf in leafBuf to the workers, or takes zeroLeaf if it's a whole leaf of zeros.
+void leafFlush(bool zeros){
+	lock_guard<mutex> lock(hashLock);
+	size_t idx = leafCount++;
+	leafHashes.resize(leafCount);
+	leafDone.resize(leafCount, 0);
+	if(zeros){
+		leafHashes[idx] = zeroLeaf;
+		leafDone[idx] = 1;
+		checkLeaves();
+	}
+	else{
+		hashJobs.push_back(make_pair(idx, move(leafBuf)));
+		hashPending++;
+		hashReady.notify_one();
+	}
+	leafBuf = vector<unsigned char>();
+	leafBuf.reserve(LEAF_BYTES);
+}
+
+// Adds len bytes of the data stream (zeros if data is NULL) to the leaves.
+void leafAdd(const unsigned char *data, off_t len){
+	while(len > 0){
+		if(data == NULL && leafBuf.empty() && len >= LEAF_BYTES){
+			leafFlush(true);
+			len -= LEAF_BYTES;
+			continue;
+		}
+		size_t part = min(len, (off_t)(LEAF_BYTES - leafBuf.size()));
+		if(data != NULL){
+			leafBuf.insert(leafBuf.end(), data, data + part);
+			data += part;
+		}
+		else
+			leafBuf.resize(leafBuf.size() + part, 0);
+		len -= part;
+		if(leafBuf.size() == LEAF_BYTES)
+			leafFlush(false);
+	}
+}
+
+// Hashes what is left and waits for the workers. Returns the root over all the leaves.
+uint64_t leafFinish(){
+	if(!leafBuf.empty())
+		leafFlush(false);
+	unique_lock<mutex> lock(hashLock);
+	hashDone.wait(lock, []{ return hashPending == 0; });
+	return merkleRoot(leafHashes);
+}
+
+// Clears the leaves for the next transfer.
+void leafReset(){
+	lock_guard<mutex> lock(hashLock);
+	leafHashes.clear();
+	leafDone.clear();
+	leafCount = 0;
+	leafBuf.clear();
+	leafBuf.reserve(LEAF_BYTES);
+	serverLeaves.clear();
+	leafChecked = 0;
+	badLeaves.clear();
+	manifestAsked = SIZE_MAX;
+}
+
+// Asks the server for its leaf hashes from first on.
+void askManifest(int &sock, struct sockaddr_in &serverAddr, uint32_t first){
+	char toSend[9];
+	ratsHead sendHdr;
+	sendHdr.opCode = 0x0A;
+	sendHdr.seqNum = first;
+	sendHdr.size = 0;
+	sendHdr.check = 0;
+	memcpy(toSend, &sendHdr.opCode, 1);
+	memcpy(toSend + 1, &sendHdr.seqNum, 4);
+	memcpy(toSend + 5, &sendHdr.size, 2);
+	memcpy(toSend + 7, &sendHdr.check, 2);
+	sendHdr.check = generateChecksum(toSend, 9);
+	memcpy(toSend + 7, &sendHdr.check, 2);
+	if(sendto(sock, toSend, 9, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+		perror("Error requesting manifest\n");
+}
 
-	expected = (*sequence.end()) + 1;
+// Takes the leaf hashes in a 0x0A if they are the next ones we need, and checks what it can
+// against them. Returns false if the packet is anything else.
+bool addManifest(char *buf, int recLen){
+	ratsHead recHdr;
+	memcpy(&recHdr.opCode, buf, 1);
+	memcpy(&recHdr.seqNum, buf + 1, 4);
+	memcpy(&recHdr.size, buf + 5, 2);
+	if(checkChecksum(buf, recLen) != 0 || recHdr.opCode != 0x0A || recHdr.size == 0 || recLen < 9 + recHdr.size)
+		return false;
+	lock_guard<mutex> lock(hashLock);
+	if(recHdr.seqNum != serverLeaves.size())
+		return false;
+	for(int i = 0; i + 8 <= recHdr.size; i += 8){
+		uint64_t h;
+		memcpy(&h, buf + 9 + i, 8);
+		serverLeaves.push_back(h);
+	}
+	checkLeaves();
+	return true;
+}
 
-	// Looking for a difference greater than 1. If there is one, we expected the current element + 1.
-	// If no difference, we expect end + 1.
-	for(auto a = sequence.begin(); a != sequence.end(); ++a){
-		auto b = a;
-		++b;
-		if((*a - *b) > 1){
-			if(((*a)+1) == startWin)
-				expected = *(a) + 1;
+// Fetches the rest of the server's leaf hashes (it waits for them between 0x05 and 0x06).
+// Returns false if it stopped answering.
+bool fetchManifest(int &sock, struct sockaddr_in &serverAddr, uint32_t count){
+	int tries = 0;
+	while(serverLeaves.size() < count){
+		askManifest(sock, serverAddr, serverLeaves.size());
+
+		// Anything else (a resent 0x05) is skipped. Times out with SO_RCVTIMEO.
+		char buf[1024];
+		int recLen;
+		while((recLen = recvPacket(sock, serverAddr, buf)) >= 0 && !addManifest(buf, recLen))
+			;
+		if(recLen < 0){
+			if(++tries > 5)
+				return false;
+			continue;
 		}
+		tries = 0;
+	}
+	return true;
+}
+
+// Checks the data against the server's root once the transfer is over, filling in badLeaves.
+// If the roots differ the server's leaf hashes not fetched during the transfer are fetched now to
+// find which leaves are wrong; with a single leaf the root is that leaf's hash. Leaves that can't
+// be checked count as bad.
+void verifyData(int &sock, struct sockaddr_in &serverAddr, uint64_t root, uint32_t count){
+	uint64_t ours = leafFinish();
+	if(ours == root && leafCount == count){
+		lock_guard<mutex> lock(hashLock);
+		badLeaves.clear();
+		printf("Data verified, %zu leaves\n", leafCount);
+		return;
+	}
+	if(count == 1 && serverLeaves.empty()){
+		lock_guard<mutex> lock(hashLock);
+		serverLeaves.push_back(root);
 	}
+	else if(count > 1 && !fetchManifest(sock, serverAddr, count))
+		printf("Server sent no manifest, fetching the unchecked leaves again\n");
+	lock_guard<mutex> lock(hashLock);
+	checkLeaves();
+	for(size_t i = leafChecked; i < count; i++)
+		badLeaves.push_back(i);
+	printf("%zu of %u leaves failed verification\n", badLeaves.size(), count);
+}
+
+// File byte ranges stream bytes [from, from + len) were written to, added onto out.
+void streamRanges(vector<struct byteRange> &out, off_t from, off_t len){
+	if(ranges.empty()){
+		out.push_back({from, len});
+		return;
+	}
+	off_t at = 0; // Stream offset where r starts
+	for(auto &r : ranges){
+		off_t start = max(from, at);
+		off_t end = min(from + len, at + r.length);
+		if(start < end)
+			out.push_back({r.offset + (start - at), end - start});
+		at += r.length;
+	}
+}
 
-	char toSend[13];
+// Sends a cumulative ACK for everything below startWin, with our receiver window.
+void sendAck(int &sock, struct sockaddr_in &serverAddr, FILE *file){
+	// Everything below startWin has been written, so that is the next packet we need.
+	uint32_t expected = startWin;
+	uint32_t window = recvWindow(sock, file);
+
+	char toSend[17];
 	char *sendCurrent = toSend;
 	ratsHead sendHdr;
 		
@@ -271,7 +680,7 @@ void fileData(int &sock, struct sockaddr_in &serverAddr, FILE* file, bool &first
 	memcpy(sendCurrent, &sendHdr.seqNum, 4);
 	sendCurrent += 4;
 
-	sendHdr.size = 4;
+	sendHdr.size = 8;
 	memcpy(sendCurrent, &sendHdr.size, 2);
 	sendCurrent += 2;
 
@@ -280,23 +689,558 @@ void fileData(int &sock, struct sockaddr_in &serverAddr, FILE* file, bool &first
 	sendCurrent += 2;
 
 	memcpy(sendCurrent, &expected, 4);
+	memcpy(sendCurrent + 4, &window, 4);
 
-	printf("seq num sending %d\n", expected);
+	if(verbose)
+		printf("seq num sending %d window %d\n", expected, window);
 
-	auto check = generateChecksum(toSend, 13);
+	auto check = generateChecksum(toSend, 17);
 	sendHdr.check = check;
 	sendCurrent -= 2;
 	memcpy(sendCurrent, &sendHdr.check, 2);
-	printf("Sending file data ACK\n");
-	int err = sendto(sock, toSend, 13, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
+	if(verbose)
+		printf("Sending file data ACK\n");
+	int err = sendto(sock, toSend, 17, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
 	if(err < 0){
 		perror("Error sending ack\n");
 	}
+	ackWindow = window;
+	ackEvery = max(1, min(ackFlight, (int)window) / 2);
+	unacked = 0;
+	ackDue = 0;
 	return;
 }
 
-int main(){
+// fileData handles one event: a packet from the server, the delayed ACK timer running out, or
+// nothing arriving at all. Needs the socket, serverAddr, File Pointer, and the remaining 3
+// parameters are if the original packet needs to be resent.
+void fileData(int &sock, struct sockaddr_in &serverAddr, FILE* file, bool &first, char *oldPacket, uint16_t &size){
+	char buf[1024];
+
+	// Wait for the next packet, but no longer than a pending delayed ACK can wait.
+	if(batchNext == batchCount){
+		int waitMs = 2000;
+		if(ackDue > 0)
+			waitMs = max(0, (int)ceil((ackDue - nowSec()) * 1000));
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, waitMs) == 0){
+			if(ackDue > 0){
+				// Timer ran out before ackEvery packets came, so the server has stopped and waits on
+				// us: what came since the last ACK is about its window. If that is all we advertised,
+				// ours is the limit and ackEvery follows it as it grows again.
+				ackFlight = unacked >= (int)ackWindow ? INT_MAX : max(1, unacked);
+				sendAck(sock, serverAddr, file);
+				return;
+			}
+			// If timeout error and was the first send, send file request again.
+			if(first){
+				int err = sendto(sock, oldPacket, (9 + size), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
+				if(err < 0){
+					perror("Error requesting file: timeout\n");
+				}
+				first = false;
+				return;
+			}
+			// Nothing for a while. Our last ACK may have been lost, say it again.
+			sendAck(sock, serverAddr, file);
+			return;
+		}
+	}
+
+	int recLen = recvPacket(sock, serverAddr, buf);
+	if(recLen < 0) // Nothing arrived, nothing to parse.
+		return;
+	first = false;
+
+	ratsHead recHdr;
+	char *current = buf;
+	memcpy(&recHdr.opCode, current, 1);
+	current++;
+	memcpy(&recHdr.seqNum, current, 4);
+	current+= 4;
+	memcpy(&recHdr.size, current, 2);
+	current += 2;
+	memcpy(&recHdr.check, current, 2);
+	current += 2;
+
+	// Checksum. If bad, just drop.
+	if(checkChecksum(buf, recLen) != 0){
+		if(verbose)
+			printf("Dropped packet: bad checksum seq is %d\n", recHdr.seqNum);
+		return;
+	}
+
+	// If File Not Found error, ack back and close.
+	if(recHdr.opCode == 0x03){
+		printf("Got file does not exist packet\n");
+		char toSend[9];
+		char *sendCurrent = toSend;
+		ratsHead sendHdr;
+	
+		sendHdr.opCode = 0x04;
+		memcpy(sendCurrent, &sendHdr.opCode, 1);
+		sendCurrent++;
+	
+		sendHdr.seqNum = 0;
+		memcpy(sendCurrent, &sendHdr.seqNum, 4);
+		sendCurrent += 4;
+
+		sendHdr.size = 0;
+		memcpy(sendCurrent, &sendHdr.size, 2);
+		sendCurrent += 2;
+
+		sendHdr.check = 0;
+		memcpy(sendCurrent, &sendHdr.check, 2);
+
+		auto check = generateChecksum(toSend, 9);
+		sendHdr.check = check;
+		memcpy(sendCurrent, &sendHdr.check, 2);
+		printf("Sending file does not exist ACK\n");
+		int err = sendto(sock, toSend, 9, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
+		if(err<0){
+			perror("Error sending Error ACK\n");
+			return;
+		}
+		notDone = false;
+		return;
+	}
+
+	// Leaf hashes asked for during the transfer.
+	if(recHdr.opCode == 0x0A){
+		addManifest(buf, recLen);
+		return;
+	}
+
+	// If File done, ack back and return. One from an earlier round is left over, drop it.
+	if(recHdr.opCode == 0x05){
+		if(recHdr.seqNum != verifyRound){
+			printf("Dropped file done packet from round %u\n", recHdr.seqNum);
+			return;
+		}
+		printf("Got file done packet\n");
+		if(recHdr.size >= 12){
+			uint64_t root;
+			uint32_t count;
+			memcpy(&root, current, 8);
+			memcpy(&count, current + 8, 4);
+			verifyData(sock, serverAddr, root, count);
+		}
+		char toSend[9];
+		char *sendCurrent = toSend;
+		ratsHead sendHdr;
+	
+		sendHdr.opCode = 0x06;
+		memcpy(sendCurrent, &sendHdr.opCode, 1);
+		sendCurrent++;
 	
+		sendHdr.seqNum = verifyRound;
+		memcpy(sendCurrent, &sendHdr.seqNum, 4);
+		sendCurrent += 4;
+
+		sendHdr.size = 0;
+		memcpy(sendCurrent, &sendHdr.size, 2);
+		sendCurrent += 2;
+
+		sendHdr.check = 0;
+		memcpy(sendCurrent, &sendHdr.check, 2);
+
+		auto check = generateChecksum(toSend, 9);
+		sendHdr.check = check;
+		memcpy(sendCurrent, &sendHdr.check, 2);
+		printf("Sending file done sending ACK\n");
+		int err = sendto(sock, toSend, 9, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
+		if(err<0){
+			perror("Error sending Error ACK\n");
+			return;
+		}
+		notDone = false;
+		return;
+	}
+
+	uint32_t seq = recHdr.seqNum;
+	if(verbose)
+		printf("Data packet: seq is %u\n", seq);
+
+	// Already written: the server missed an ACK, send one right away. Beyond what we
+	// advertised room for: drop.
+	if(seq < (uint32_t)startWin){
+		sendAck(sock, serverAddr, file);
+		return;
+	}
+	if(seq >= (uint32_t)startWin + REORDER_SLOTS)
+		return;
+
+	// Already held out of order: the server resent it, so it is missing an ACK too.
+	if(sequence.find(seq) != sequence.end()){
+		sendAck(sock, serverAddr, file);
+		return;
+	}
+
+	// if this sequence has not yet been found, add packet info in order.
+	bool hadGap = !packetsRec.empty();
+	if(recHdr.opCode == 0x07){
+		if(recHdr.size < 8)
+			return;
+		lastSeq = seq;
+		memcpy(&lastRoot, current, 8);
+	}
+	if(recHdr.size > 0){
+		struct packetData data;
+		data.zeroRun = 0;
+		if(recHdr.opCode == 0x07) // Just the root, no data to write.
+			recHdr.size = 0;
+		else if(recHdr.opCode == 0x08){
+			if(recHdr.size < 4)
+				return;
+			memcpy(&data.zeroRun, current, 4);
+			if(data.zeroRun == 0)
+				return;
+		}
+		else
+			memcpy(&data, current, recHdr.size);
+		auto entry = make_tuple((int)seq, data, (size_t)recHdr.size);
+		packetsRec.insert(upper_bound(packetsRec.begin(), packetsRec.end(), entry, tupleCompare), entry);
+		sequence.insert(seq);
+	}
+
+	// If the lowest recieved packet is our start window, can write. Increment start and end win, pop.
+	int written = 0;
+	while(!packetsRec.empty() && get<0>(packetsRec.front()) == startWin){
+		struct packetData &data = get<1>(packetsRec.front());
+		sequence.erase(startWin);
+		if(data.zeroRun > 0){
+			leafAdd(NULL, (off_t)data.zeroRun * 1015);
+			writeOut(file, NULL, (off_t)data.zeroRun * 1015);
+			startWin += data.zeroRun;
+			endWin += data.zeroRun;
+		}
+		else{
+			leafAdd(data.data, get<2>(packetsRec.front()));
+			writeOut(file, data.data, get<2>(packetsRec.front()));
+			startWin++;
+			endWin++;
+		}
+		written++;
+		packetsRec.pop_front();
+	}
+	unacked += written;
+
+	// Ask for the server's hashes of the leaves written so far once there is a packet's worth, so
+	// they get checked along the way. Asked again if the answer doesn't come.
+	if(written > 0 && leafCount >= serverLeaves.size() + MANIFEST_LEAVES
+			&& (manifestAsked != serverLeaves.size() || nowSec() > manifestAt + 0.5)){
+		manifestAsked = serverLeaves.size();
+		manifestAt = nowSec();
+		askManifest(sock, serverAddr, manifestAsked);
+	}
+
+	// Small file is all here: one final ACK and we are done, the server sends no 0x05.
+	if(lastSeq >= 0 && startWin > lastSeq){
+		printf("Got last packet of small file\n");
+		sendAck(sock, serverAddr, file);
+		verifyData(sock, serverAddr, lastRoot, lastSeq > 0 ? 1 : 0);
+		notDone = false;
+		return;
+	}
+
+	// A gap showing up (out of order arrival) or getting filled goes back to the server straight
+	// away so loss recovery is not held up. Otherwise ACK every ackEvery packets, or when the
+	// timer runs out.
+	bool gap = !packetsRec.empty();
+	if((gap && !hadGap) || (hadGap && written > 0) || unacked >= ackEvery)
+		sendAck(sock, serverAddr, file);
+	else if(ackDue == 0)
+		ackDue = nowSec() + ACK_DELAY_MS / 1000.0;
+	return;
+}
+
+// Opens where the file gets saved: outPath, or the requested path if that is blank, or stdout
+// for "-". Returns NULL if it can't be opened.
+FILE *openOutput(const char *outPath, const char *filep, bool ranged){
+	FILE *file;
+	if(strcmp(outPath, "-") == 0){
+		// File data goes to the real stdout, messages (and anything still buffered) go to stderr.
+		int out = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		file = fdopen(out, "wb");
+		streamOut = true;
+	}
+	else{
+		const char *path = outPath[0] != '\0' ? outPath : filep;
+		// A range request fills in those bytes of an existing copy, so don't truncate it.
+		file = NULL;
+		if(ranged)
+			file = fopen(path, "r+b");
+		if(file == NULL)
+			file = fopen(path, "wb");
+	}
+	if(file == NULL)
+		perror("Can't open file to save to\n");
+	return file;
+}
+
+// Stands in for len bytes of a hole at pos in the output. A file just keeps the hole (punching
+// out anything that was there), a stream gets zeros.
+int holeLocal(int out, off_t pos, off_t len){
+	static const char zeros[4096] = {0};
+	struct stat status;
+	if(!streamOut){
+		if(fstat(out, &status) < 0)
+			return -1;
+		if(pos >= status.st_size || fallocate(out, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len) == 0)
+			return 0;
+	}
+	while(len > 0){
+		ssize_t n = min(len, (off_t)sizeof(zeros));
+		n = streamOut ? write(out, zeros, n) : pwrite(out, zeros, n, pos);
+		if(n <= 0)
+			return -1;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Copies len bytes of data at pos from in to the output, in the kernel where it can:
+// copy_file_range (a reflink on filesystems that do them) to a file, sendfile to a stream.
+int dataLocal(int in, int out, off_t pos, off_t len){
+	char buf[65536];
+	while(len > 0){
+		ssize_t n;
+		off_t outPos = pos;
+		if(!streamOut)
+			n = copy_file_range(in, &pos, out, &outPos, len, 0);
+		else
+			n = sendfile(out, in, &pos, len);
+		if(n < 0){ // Not between these two, do it by hand.
+			n = pread(in, buf, min(len, (off_t)sizeof(buf)), pos);
+			if(n > 0)
+				n = streamOut ? write(out, buf, n) : pwrite(out, buf, n, pos);
+			if(n > 0)
+				pos += n;
+		}
+		if(n <= 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+// Copies one range of in to the output, to the same offset or appended when streaming. Only the
+// data is copied, holes stay holes.
+int copyLocal(int in, int out, off_t offset, off_t length){
+	off_t end = offset + length;
+	off_t pos = offset;
+	while(pos < end){
+		off_t dataAt = lseek(in, pos, SEEK_DATA);
+		if(dataAt < 0 || dataAt > end)
+			dataAt = end;
+		off_t holeAt = dataAt < end ? lseek(in, dataAt, SEEK_HOLE) : end;
+		if(holeAt < 0 || holeAt > end)
+			holeAt = end;
+		if(dataAt > pos && holeLocal(out, pos, dataAt - pos) < 0)
+			return -1;
+		if(holeAt > dataAt && dataLocal(in, out, dataAt, holeAt - dataAt) < 0)
+			return -1;
+		pos = holeAt;
+	}
+	// A hole at the end of the range leaves the file short.
+	struct stat status;
+	if(!streamOut && fstat(out, &status) == 0 && status.st_size < end && ftruncate(out, end) < 0)
+		return -1;
+	return 0;
+}
+
+// Builds the request for filep into toSend (room for 1024 bytes). Ranges go after the path and a
+// zero byte when ranged, as many as fit in one packet; the rest are cut from ranges, for the
+// caller to ask for in the next request. Returns the packet size.
+int buildRequest(char *toSend, const char *filep, bool ranged){
+	ratsHead sendHdr;
+	sendHdr.opCode = 0x00;
+	sendHdr.seqNum = 0;
+	// RATS_CLASS and RATS_WEIGHT ask the server for a priority class and a weight.
+	char *cls = getenv("RATS_CLASS");
+	char *weight = getenv("RATS_WEIGHT");
+	if(cls != NULL && atoi(cls) >= 0)
+		sendHdr.seqNum |= min(atoi(cls) + 1, 255);
+	if(weight != NULL && atoi(weight) > 0)
+		sendHdr.seqNum |= min(atoi(weight), 255) << 8;
+	sendHdr.seqNum |= verifyRound << 16;
+	size_t pathLen = strlen(filep);
+	size_t rangeCount = 0;
+	if(ranged){
+		rangeCount = pathLen + 1 < 1015 ? min(ranges.size(), (1015 - pathLen - 1) / 16) : 0;
+		ranges.resize(rangeCount);
+	}
+	sendHdr.size = pathLen + (ranged ? 1 + 16 * rangeCount : 0);
+	printf("Size is %d\n", sendHdr.size);
+	sendHdr.check = 0;
+
+	char *current = toSend;
+	memcpy(current, &sendHdr.opCode, 1);
+	current++;
+	memcpy(current, &sendHdr.seqNum, 4);
+	current += 4;
+	memcpy(current, &sendHdr.size, 2);
+	current += 2;
+	memcpy(current, &sendHdr.check, 2);
+
+	current += 2;
+	memcpy(current, filep, pathLen);
+	if(ranged){
+		current[pathLen] = '\0';
+		for(size_t i = 0; i < rangeCount; i++){
+			uint64_t offset = ranges[i].offset;
+			uint64_t length = ranges[i].length;
+			memcpy(current + pathLen + 1 + 16 * i, &offset, 8);
+			memcpy(current + pathLen + 1 + 16 * i + 8, &length, 8);
+		}
+	}
+	sendHdr.check = generateChecksum(toSend, 9 + sendHdr.size);
+	current -= 2;
+	memcpy(current, &sendHdr.check, 2);
+	return 9 + sendHdr.size;
+}
+
+// Gets ready for another transfer into file, of the data in ranges: empties the receive state and
+// throws away anything left over from the last one.
+void resetTransfer(int &sock, FILE *file){
+	notDone = true;
+	startWin = 0;
+	endWin = 4;
+	packetsRec.clear();
+	sequence.clear();
+	lastSeq = -1;
+	unacked = 0;
+	ackDue = 0;
+	batchNext = batchCount;
+	char buf[1024];
+	while(recv(sock, buf, sizeof(buf), MSG_DONTWAIT) >= 0)
+		;
+	leafReset();
+	curRange = 0;
+	rangeLeft = ranges.empty() ? 0 : ranges[0].length;
+	if(!ranges.empty() && !streamOut)
+		fseeko(file, ranges[0].offset, SEEK_SET);
+}
+
+// Fills in the server's local socket address for port. Returns its length: abstract names are
+// not NUL terminated, the length is what ends them.
+socklen_t localAddr(struct sockaddr_un &addr, int port){
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, LOCAL_SOCKET, port);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1);
+}
+
+// Same-host fast path. If ip is one of this host's addresses and the server is listening on its
+// local socket, it sends back the open file itself (the descriptor, over the socket) and we copy
+// it, never going through UDP. Returns 0 if there is no local server to use, 1 when the file was
+// fetched, -1 if that failed. wanted is every range asked for, not just those the request holds.
+int fetchLocal(const char *ip, int port, char *request, int requestLen, const char *outPath, const char *filep, bool ranged, const vector<struct byteRange> &wanted){
+	char *local = getenv("RATS_LOCAL");
+	if(local != NULL && strcmp(local, "off") == 0)
+		return 0;
+
+	// Binding to the address only works if it is ours.
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+	addr.sin_port = 0;
+	int probe = socket(AF_INET, SOCK_DGRAM, 0);
+	bool ours = probe >= 0 && bind(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	if(probe >= 0)
+		close(probe);
+	if(!ours)
+		return 0;
+
+	struct sockaddr_un unixAddr;
+	socklen_t addrLen = localAddr(unixAddr, port);
+	int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(conn < 0)
+		return 0;
+	if(connect(conn, (struct sockaddr *)&unixAddr, addrLen) < 0){
+		close(conn);
+		return 0;
+	}
+	// Anyone can bind an abstract name, so only take a descriptor from root or our own user.
+	struct ucred peer;
+	socklen_t peerLen = sizeof(peer);
+	if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) < 0 || (peer.uid != 0 && peer.uid != getuid())){
+		printf("Local socket is not the server's, using UDP\n");
+		close(conn);
+		return 0;
+	}
+	if(send(conn, request, requestLen, 0) < 0){
+		close(conn);
+		return 0;
+	}
+	printf("Server is on this host, fetching locally\n");
+
+	// Reply is a header (0x09 with the file size, or 0x03) with the file descriptor attached.
+	char reply[17];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(reply);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	int recLen = recvmsg(conn, &msg, 0);
+	close(conn);
+	int in = -1;
+	struct cmsghdr *cm = recLen > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if(cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+		memcpy(&in, CMSG_DATA(cm), sizeof(int));
+
+	if(recLen >= 9 && checkChecksum(reply, recLen) == 0 && reply[0] == 0x03){
+		printf("Got file does not exist packet\n");
+		return -1;
+	}
+	if(recLen < 17 || checkChecksum(reply, recLen) != 0 || reply[0] != 0x09 || in < 0){
+		printf("Bad reply on local socket, using UDP\n");
+		if(in >= 0)
+			close(in);
+		return 0;
+	}
+	uint64_t size;
+	memcpy(&size, reply + 9, 8);
+
+	FILE *file = openOutput(outPath, filep, ranged);
+	if(file == NULL){
+		close(in);
+		return -1;
+	}
+	fflush(file);
+	// The size is known here, so cut the ranges off ourselves.
+	vector<struct byteRange> list = wanted;
+	if(!ranged)
+		list.push_back({0, (off_t)size});
+	normalizeRanges(list, size);
+	int result = 1;
+	for(auto &r : list){
+		if(copyLocal(in, fileno(file), r.offset, r.length) < 0){
+			perror("Local copy failed\n");
+			result = -1;
+			break;
+		}
+	}
+	close(in);
+	fclose(file);
+	return result;
+}
+
+int main(){
+	char *io = getenv("RATS_IO");
+	if(io != NULL && strcmp(io, "blocking") == 0)
+		batchIO = 0;
+	verbose = getenv("RATS_VERBOSE") != NULL;
 
 
 
@@ -334,7 +1278,7 @@ int main(){
 		int i = 0;
 		
 		// Loop checks each character of current section to see if numeric.
-		while(i < strlen(temp) - 1)
+		while(i < (int)strlen(temp) - 1)
 		{
 			if (isdigit(temp[i])){
 				i++;
@@ -368,53 +1312,63 @@ int main(){
 	char *filep = (char *)malloc(256);
 	fgets(filep, 256, stdin);
 
+	printf("Enter byte ranges as offset:length, comma separated (blank for the whole file): ");
+	char rangeLine[4096];
+	if(fgets(rangeLine, 4096, stdin) == NULL)
+		rangeLine[0] = '\0';
+	// Cutting the list short would quietly fetch less than was asked for.
+	if(strchr(rangeLine, '\n') == NULL && !feof(stdin)){
+		printf("Too many byte ranges, %zu characters at most\n", sizeof(rangeLine) - 2);
+		return 1;
+	}
+	bool ranged = strspn(rangeLine, " \n") < strlen(rangeLine);
+	parseRanges(rangeLine);
 
-	// Setting up struct for bind. Using htonl to be portable and extra safe.
-	struct sockaddr_in myAddr, serverAddr;
-	myAddr.sin_family = AF_INET;
-	myAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	myAddr.sin_port = htons(atoi(port));
+	printf("Enter where to save it (blank for the same path, - for stdout): ");
+	char outPath[256];
+	if(fgets(outPath, 256, stdin) == NULL)
+		outPath[0] = '\0';
+	outPath[strcspn(outPath, "\n")] = '\0';
 
 
-	int e = bind(sock, (struct sockaddr *)&myAddr, sizeof(myAddr));
-	if(e < 0){
-		perror("Bind didn't work\n");
-		return 1;
-	}
 	filep = strtok(filep, "\n");
 
+	struct sockaddr_in myAddr, serverAddr;
 	serverAddr.sin_family = AF_INET;
 	serverAddr.sin_addr.s_addr = inet_addr(ip);
 	serverAddr.sin_port = htons(atoi(port));
 
-	// Send request, enter recv loop.
-	ratsHead sendHdr;
-	sendHdr.opCode = 0x00;
-	sendHdr.seqNum = 0;
-	sendHdr.size = strlen(filep);
-	printf("Size is %d\n", sendHdr.size);
-	sendHdr.check = 0;	
+	// Send request, enter recv loop. Ranges that don't fit in it are asked for in later rounds.
+	char toSend[1024];
+	vector<struct byteRange> wanted = ranges;
+	int reqLen = buildRequest(toSend, filep, ranged);
+	uint16_t reqSize = reqLen - 9;
+	vector<struct byteRange> left(wanted.begin() + ranges.size(), wanted.end()); // Ranges that didn't fit in the last request
+
+	// Server on this same host: skip UDP altogether.
+	int local = fetchLocal(ip, atoi(port), toSend, reqLen, outPath, filep, ranged, wanted);
+	if(local != 0){
+		free(filep);
+		return local > 0 ? 0 : 1;
+	}
 
-	char toSend[9 + sendHdr.size];
+	// Setting up struct for bind. Using htonl to be portable and extra safe. Same port as the
+	// server unless RATS_CLIENT_PORT says otherwise (0 for any free one), so clients can share a
+	// host with the server or each other.
+	char *clientPort = getenv("RATS_CLIENT_PORT");
+	myAddr.sin_family = AF_INET;
+	myAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	myAddr.sin_port = htons(clientPort != NULL ? atoi(clientPort) : atoi(port));
 
-	char *current = toSend;
-	memcpy(current, &sendHdr.opCode, 1);
-	current++;
-	memcpy(current, &sendHdr.seqNum, 4);
-	current += 4;
-	memcpy(current, &sendHdr.size, 2);
-	current += 2;
-	memcpy(current, &sendHdr.check, 2);
-
-	current += 2;
-	memcpy(current, filep, sendHdr.size);
-	sendHdr.check = generateChecksum(toSend, sizeof(toSend));
-	current -= 2;
-	memcpy(current, &sendHdr.check, 2);
 
+	int e = bind(sock, (struct sockaddr *)&myAddr, sizeof(myAddr));
+	if(e < 0){
+		perror("Bind didn't work\n");
+		return 1;
+	}
 
 	printf("Sending request for file %s\n", filep);
-	int err = sendto(sock, toSend, (9 + sendHdr.size), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
+	int err = sendto(sock, toSend, reqLen, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
 	if(err < 0){
 		perror("Error requesting file\n");
 		return 1;
@@ -429,15 +1383,74 @@ int main(){
 
 
 
-	FILE *file = fopen(filep, "wb");
+	FILE *file = openOutput(outPath, filep, ranged);
+	if(file == NULL)
+		return 1;
+	if(!ranges.empty()){
+		rangeLeft = ranges[0].length;
+		if(!streamOut)
+			fseeko(file, ranges[0].offset, SEEK_SET);
+	}
+	// Large stdio buffer so the per-packet fwrites in fileData turn into a few big write calls.
+	setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+	vector<unsigned char> zeros(LEAF_BYTES, 0);
+	zeroLeaf = xxh64(zeros.data(), LEAF_BYTES, 0);
+	leafReset();
+	vector<thread> hashers;
+	for(int i = 0; i < HASH_THREADS; i++)
+		hashers.push_back(thread(hashWorker));
 
 	bool first = true;
-	// Loops until flag notDone is unset when received fileDone ACK
-	while(notDone){
-		fileData(sock, serverAddr, file, first, toSend, sendHdr.size);
+	int result = 0;
+	int tries = 0;
+	off_t lastBad = INT64_MAX; // Bytes the last round had left to fetch
+	while(1){
+		// Loops until flag notDone is unset when received fileDone ACK
+		while(notDone){
+			fileData(sock, serverAddr, file, first, toSend, reqSize);
+		}
+		if(badLeaves.empty() && left.empty())
+			break;
+
+		// Ask for just the bad leaves again, written over the same spots, along with whatever
+		// didn't fit last time. A stream can't go back, so there only the leftovers can be fetched.
+		vector<struct byteRange> again = left;
+		for(size_t leaf : badLeaves)
+			streamRanges(again, (off_t)leaf * LEAF_BYTES, LEAF_BYTES);
+		normalizeRanges(again, INT64_MAX);
+		off_t bad = 0;
+		for(auto &r : again)
+			bad += r.length;
+		if(bad >= lastBad)
+			tries++;
+		lastBad = bad;
+		if((streamOut && !badLeaves.empty()) || tries > VERIFY_RETRIES){
+			printf("Could not get a good copy of the file\n");
+			result = 1;
+			break;
+		}
+		verifyRound++;
+		ranges = again;
+		reqLen = buildRequest(toSend, filep, true); // Cuts ranges down to what fits
+		left.assign(again.begin() + ranges.size(), again.end());
+		reqSize = reqLen - 9;
+		resetTransfer(sock, file);
+		printf("Requesting %zu more ranges\n", ranges.size());
+		if(sendto(sock, toSend, reqLen, 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+			perror("Error requesting file\n");
+		first = true;
 	}
 	fclose(file);
 	free(filep);
 
-	return 0;
+	{
+		lock_guard<mutex> lock(hashLock);
+		hashStop = true;
+	}
+	hashReady.notify_all();
+	for(auto &t : hashers)
+		t.join();
+
+	return result;
 }
@@ -19,9 +19,25 @@
 #include <stdint.h>
 #include <sys/stat.h>
 #include <math.h>
+#include <limits.h>
 #include <algorithm>
 #include <deque>
 #include <set>
+#include <sys/uio.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <sys/un.h>
+#include <stddef.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
 
 using namespace std;
 
@@ -32,13 +48,31 @@ using namespace std;
  *	|opcode||sequence Number||data size||Checksum|
  *	  8bits       32bits      16 bits     16bits
  *	Opcode has some wasted bits, but easier to make it a byte on it's own.
- *	Opcode is: 	0x00 - File request, data is file path.
+ *	Opcode is: 	0x00 - File request, data is file path. Can be followed by a zero byte and byte ranges
+ *				to send instead of the whole file, each a 64 bit offset and 64 bit length.
+ *				The sequence number can ask for a priority: the low byte is the class plus one (0
+ *				leaves it to the server), the next byte the weight (0 for the default). The top 16
+ *				bits are the verification round, 0 at first and one more each time bad leaves are
+ *				asked for again.
  *			0x01 - File Sending, data is file data.
- *			Ox02 - ACK, data is sequence number of packet that is being ACKed.
+ *			Ox02 - ACK, data is sequence number of next packet that is expected, then 32 bits saying
+ *				how many packets from there the client has room for (receiver window).
  *			0x03 - Error, file does not exist. Data is empty, size is set to 0.
  *			0x04 - Error ACK, data is empty.
- *			0x05 - Done Sending file, data and size are empty.
- *			0x06 - File Done ACK, data and size are empty.
+ *			0x05 - Done Sending file, data is the Merkle root of the data (64 bits) and the number
+ *				of leaves (32 bits). See the leaf hashing below. The sequence number is the round
+ *				from the request, a 0x05 from another round is dropped.
+ *			0x06 - File Done ACK, data and size are empty. The sequence number is the round again.
+ *			0x07 - Last packet of a small file, comes right after the data with the Merkle root (64
+ *				bits) as its data. It stands in for 0x05, the client's ACK of it ends the transfer, no 0x06.
+ *			0x08 - Zero Range, data is a 32 bit count. Stands for that many packets of all zeros
+ *				starting at the sequence number (holes in a sparse file, or zeros read from it).
+ *			0x09 - Local File, only over the local socket: data is the 64 bit file size and the file
+ *				descriptor is attached, the client copies the file itself.
+ *			0x0A - Manifest. From the client, asks for the leaf hashes from the sequence number on
+ *				(data is empty); the server answers with the same sequence number and as many of the
+ *				64 bit hashes as fit in a packet. Sent during the transfer for leaves the client has
+ *				written, and between 0x05 and 0x06 for the rest.
  *	Sequence Number is packet num. 32 bits are used to allow for large files being transferred.
  *	Data size: The size of the data section in bytes. For this project, goes up to 1024, but did 2 bytes
  *			for ease of implementation. 
@@ -53,21 +87,193 @@ typedef struct{
 	uint16_t check;
 }ratsHead;
 
+// Messages for every packet only come out with RATS_VERBOSE set: printing them costs more than
+// sending the packet does.
+bool verbose = false;
 
-int startWin, endWin, maxWin;
-size_t fileSize;
 
-int doneSending = 0; // Switch to 1 when done.
-set <int> acks;
-deque<struct packetData> packets;
+// The window is the smaller of the session's congestion window (cwnd) and what the client last
+// said it has room for (peerWin). Always at least one packet so a full client still gets probed.
+// cwnd starts at congWin, backs off on loss and grows back, never past congWin (see
+// congestionAck). RATS_WINDOW sets congWin.
+int congWin = 32;
 
+// Files of up to SMALL_FILE_PACKETS packets go out in the first window followed by a 0x07, so the
+// transfer is over in one round trip. If the final ACK is lost the client is gone, so only wait
+// SMALL_FILE_RETRIES timeouts for it. Other transfers give up after MAX_TIMEOUTS.
+#define SMALL_FILE_PACKETS 4
+#define SMALL_FILE_RETRIES 3
+#define MAX_TIMEOUTS 5
 
-void checkRecieve(char *buf, int &size, int &sock, struct sockaddr_in &clientAddr);
+// Batched I/O. Data packets picked by the scheduler are queued and handed to the kernel with one
+// sendmmsg call instead of one sendto each, and datagrams are taken off the socket with recvmmsg.
+// Set RATS_IO=blocking to use the plain sendto/recvfrom path; it is also picked automatically if
+// the kernel does not have sendmmsg.
+#define MAX_BATCH 64
+int batchIO = 1;
+char batchBuf[MAX_BATCH][1024];
+int batchLen[MAX_BATCH];
+struct sockaddr_in batchAddr[MAX_BATCH];
+double batchDepart[MAX_BATCH]; // When each packet is due to leave, for SO_TXTIME
+int batchCount = 0;
+
+// Pacing. Instead of firing a window back-to-back, each transfer's packets are spread over half
+// the smallest RTT it has seen (the 2x gain TCP paces with in slow start). RATS_PACE picks how:
+// "timer" (default) holds packets in the server until they are due, "txtime" stamps each packet
+// with SO_TXTIME and lets the fq qdisc release it (so it can be handed over up to TXTIME_AHEAD
+// early), "off" sends windows back-to-back.
+#define PACE_OFF 0
+#define PACE_TIMER 1
+#define PACE_TXTIME 2
+#define TXTIME_AHEAD 0.002
+int pacing = PACE_TIMER;
+
+// Token bucket rate limit. Rate is bytes per second, 0 means unlimited. Tokens may go negative,
+// which is just time the next packet has to wait.
+struct tokenBucket{
+	double rate;
+	double burst;
+	double tokens;
+	double last;
+};
+// RATS_RATE caps each transfer, RATS_SERVER_RATE caps everything this server sends.
+double transferRate = 0;
+struct tokenBucket serverBucket = {0, 0, 0, 0};
 
 struct packetData{
 	size_t dataSize;
 	unsigned char data[1015];
+	int seq;
+	uint32_t zeroRun; // Packets of zeros this one stands for (sent as 0x08), 0 for file data.
+};
+
+// Byte range of a file. A transfer sends its ranges one after the other.
+struct byteRange{
+	off_t offset;
+	off_t length;
+};
+
+// Longest zero range one 0x08 packet covers, so a huge run doesn't hold everything else up.
+#define MAX_ZERO_RUN 65536
+
+/*
+ *	Sessions. Every transfer is a session, found by the client's address. One loop (see main)
+ *	runs them all: datagrams are handed to their session, and the scheduler picks whose packets
+ *	go out next.
+ *
+ *	Scheduling: sessions are in NUM_CLASSES priority classes, and a class only sends when every
+ *	class before it has nothing ready, but for a floor share: whatever a class sends earns each
+ *	class after it that has sessions CLASS_FLOOR percent as much in credit, which it gets to send
+ *	ahead of the others. So a class 0 that always has something ready can't starve the rest.
+ *	Within a class it is deficit round robin: each turn a
+ *	session gets QUANTUM bytes of credit per unit of weight and sends packets while the credit
+ *	covers them, so sessions share in proportion to their weights however big their packets are.
+ *	A session with nothing ready (window full, or not due yet) loses its credit.
+ *
+ *	Class and weight: transfers of up to INTERACTIVE_BYTES are class 0 and the rest class 1,
+ *	weight 1. RATS_CLASSES sets them for client subnets instead, as
+ *	"10.0.0.0/8=1:4,192.168.1.0/24=2" (class, then an optional weight). A client can ask for a
+ *	lower priority class or a smaller weight in its request, never more than it would get.
+ *
+ *	Admission: a new session waits in its class's queue until the server has room for it: each
+ *	session is counted as SESSION_MEMORY bytes against RATS_MEMORY (MiB), and with
+ *	RATS_SERVER_RATE set every session has to be left at least RATS_MIN_RATE bytes per second.
+ *	Queued sessions are let in class 0 first, then in order of arrival.
+ *
+ *	Every RATS_STATS seconds (default 10, 0 for never) each class's throughput, sessions and
+ *	queueing delay are printed.
+*/
+#define NUM_CLASSES 3
+#define INTERACTIVE_BYTES (1 << 20)
+#define QUANTUM 4096
+#define CLASS_FLOOR 10 // Percent
+#define MAX_FLOOR_CREDIT (64 * 1024) // Bytes, so a class that is idle a while doesn't bank a burst
+#define MAX_QUEUED 1024
+
+#define SESSION_QUEUED 0
+#define SESSION_SENDING 1
+#define SESSION_DONE 2 // Everything ACKed and 0x05 sent, waiting on the 0x06
+
+struct session{
+	struct sockaddr_in addr;
+	int state;
+	char request[1024]; // The 0x00 that started it, to tell a resent request from a new one
+	int requestLen;
+	int cls;
+	int weight;
+	int deficit; // DRR credit, bytes
+	bool inTurn; // Got its quantum and is still at the front of its class
+	double arrived; // When the request came in
+	int timeouts;
+	double timerAt; // When the retransmission timer runs out, 0 if it isn't running
+	bool failed; // The file came up short while reading, nothing more gets sent
+
+	string path; // Relative to the root
+	FILE *file; // Opened when the session is let in, NULL while it is queued
+	off_t fileLen;
+	vector<struct byteRange> ranges; // What is being sent, in order (see normalizeRanges)
+	size_t curRange; // Range being read
+	off_t rangeLeft; // Bytes of it not read yet
+	size_t fileSize; // Bytes of the data stream not read yet
+	off_t holeStart; // Where the next hole starts, at or after what's being read
+	int nextRead; // Seq of the next chunk to read from the file
+	deque<struct packetData> packets; // Read and not ACKed yet, in seq order
+
+	int startWin, endWin, maxWin;
+	int lastData; // Seq of the last data packet, before the 0x07 on the fast path
+	int peerWin;
+	int cwnd; // Congestion window, packets
+	int ssthresh; // Below it cwnd grows by what is ACKed, above it by a packet a window
+	int cwndAcked; // Packets ACKed toward the next one-packet increase
+	int recoverSeq; // Sent when cwnd was last cut, no new cut until it is ACKed
+	int fastPath;
+	// Packets up to sentUpTo are in flight and only go out again on a timeout, or as resendSeq
+	// when an ACK comes back without moving startWin (the client has a gap there). That fast
+	// resend happens once per startWin, lastResent remembers which.
+	int sentUpTo;
+	int resendSeq;
+	int lastResent;
+
+	double minRtt; // Seconds, 0 until the first ACK comes back
+	int sampleSeq; // Packet being timed for an RTT sample, -1 if none
+	int sampledUpTo;
+	double sampleSent;
+	double nextDepart; // When pacing lets the next packet go
+	struct tokenBucket bucket;
+
+	vector<uint64_t> leafHashes; // Merkle leaves, see below
+	vector<unsigned char> leafBuf; // Leaf being filled
+	uint32_t round; // Verification round from the request, goes in the 0x05 and comes back in the 0x06
+	char done[9 + 12]; // The 0x05, kept for resending
+};
+
+unordered_map<uint64_t, struct session *> sessions; // By client address, see sessionKey
+deque<struct session *> queued[NUM_CLASSES]; // Waiting for admission
+deque<struct session *> active[NUM_CLASSES]; // Round robin order
+long floorCredit[NUM_CLASSES]; // Bytes a class may send ahead of the classes before it
+int admitted = 0; // Sessions sending or done
+
+struct classRule{
+	uint32_t net;
+	uint32_t mask;
+	int cls;
+	int weight;
+};
+vector<struct classRule> classRules;
+size_t memoryBudget = (size_t)256 << 20;
+double minRate = 65536;
+#define SESSION_MEMORY ((size_t)(1 << 20) + congWin * sizeof(struct packetData) + LEAF_BYTES)
+
+struct classStats{
+	uint64_t bytes; // Sent since the last report
+	long sessions; // Admitted since the last report
+	double delay; // Total queueing delay of those
+	double maxDelay;
+	long finished;
 };
+struct classStats stats[NUM_CLASSES];
+double statsEvery = 10;
+double lastStats = 0;
 
 uint16_t generateChecksum(char *buf, int size)
 {
@@ -84,6 +290,9 @@ uint16_t generateChecksum(char *buf, int size)
 		size -= 2;
 		place += 2;
 	}
+	// Odd trailing byte counts as if padded with a zero.
+	if(size == 1)
+		sum += place[0];
 	// More Carries
 	while (sum >> 16)
 		sum = (sum & 0xFFFF) + (sum >> 16);
@@ -95,34 +304,904 @@ uint16_t generateChecksum(char *buf, int size)
 // Return 1 if not valid, 0 if valid.
 int checkChecksum(char* buf, int size)
 {
-	// To check checksum, go thorugh size bytes of buf, adding as words. If end up with 0
-	// it is right.
-	
+	// The checksum sits at an odd offset (byte 7), so summing the packet with it in place does
+	// not fold to 0. Instead clear the field, regenerate, and compare against what was sent.
+	if(size < 9)
+		return 1;
+
 	// Using generateChecksum function to check it. Assuming buf points to start of header.
+	uint16_t sent;
+	memcpy(&sent, buf + 7, 2);
+	memset(buf + 7, 0, 2);
 	uint16_t check = generateChecksum(buf, size);
-	if(check == 0)
+	memcpy(buf + 7, &sent, 2);
+	if(check == sent)
 		return 0;
 	return 1;
 }
 
-// Returns the highest possible ACK following typical sliding window restrictions. 
-int checkAcks(){
-	// After sorting set of acks from least to greatest, loop through until greater than 1 diff.
-	for(auto a = acks.begin(); a != acks.end(); ++a){
-		auto b = a;
-		++b;
-		if((*a - *b) > 1)
-			return *a;
+// Monotonic clock in seconds.
+double nowSec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sets a bucket up full. Burst is one full batch so a window under the cap is never split up.
+void bucketReset(struct tokenBucket &b, double rate){
+	b.rate = rate;
+	b.burst = MAX_BATCH * 1024;
+	b.tokens = b.burst;
+	b.last = nowSec();
+}
+
+// Charges size bytes to the bucket for a packet that wants to leave at when. Returns the
+// earliest time the packet is allowed to leave.
+double bucketTake(struct tokenBucket &b, double when, int size){
+	if(b.rate <= 0)
+		return when;
+	if(when > b.last){
+		b.tokens = min(b.burst, b.tokens + (when - b.last) * b.rate);
+		b.last = when;
+	}
+	b.tokens -= size;
+	if(b.tokens >= 0)
+		return when;
+	return when + (-b.tokens) / b.rate;
+}
+
+// Earliest time the bucket lets another packet out.
+double bucketNext(struct tokenBucket &b, double now){
+	if(b.rate <= 0 || b.tokens + (now - b.last) * b.rate >= 0)
+		return now;
+	return b.last + (-b.tokens) / b.rate;
+}
+
+// Sends queued packets from up to (not including) to. Returns -1 if sending failed.
+int sendRange(int &sock, int from, int to){
+	if(batchIO){
+		struct mmsghdr msgs[MAX_BATCH];
+		struct iovec iovs[MAX_BATCH];
+		char control[MAX_BATCH][CMSG_SPACE(sizeof(uint64_t))];
+		memset(msgs, 0, sizeof(msgs));
+		memset(control, 0, sizeof(control));
+		int count = to - from;
+		for(int i = 0; i < count; i++){
+			iovs[i].iov_base = batchBuf[from + i];
+			iovs[i].iov_len = batchLen[from + i];
+			msgs[i].msg_hdr.msg_name = &batchAddr[from + i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(batchAddr[from + i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+#ifdef SO_TXTIME
+			if(pacing == PACE_TXTIME){
+				msgs[i].msg_hdr.msg_control = control[i];
+				msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+				struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+				cm->cmsg_level = SOL_SOCKET;
+				cm->cmsg_type = SCM_TXTIME;
+				cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+				uint64_t txtime = (uint64_t)(batchDepart[from + i] * 1e9);
+				memcpy(CMSG_DATA(cm), &txtime, sizeof(txtime));
+			}
+#endif
+		}
+		int done = 0;
+		while(done < count){
+			int n = sendmmsg(sock, msgs + done, count - done, 0);
+			if(n < 0){
+				if(errno == ENOSYS){ // No sendmmsg, finish with sendto and timer pacing from here on.
+					batchIO = 0;
+					if(pacing == PACE_TXTIME)
+						pacing = PACE_TIMER;
+					break;
+				}
+				return -1;
+			}
+			done += n;
+		}
+		from += done;
+	}
+	for(; from < to; from++){
+		int err = sendto(sock, batchBuf[from], batchLen[from], 0, (struct sockaddr *)&batchAddr[from], sizeof(batchAddr[from]));
+		if(err < 0)
+			return -1;
 	}
 	return 0;
 }
 
-// checkRecieve checks a packet to see if it is an ACK or a request for a file. 
+// Sends every queued packet. The scheduler only queues packets that are due, so they all go
+// now. Returns -1 if sending failed.
+int flushBatch(int &sock){
+	if(batchCount == 0)
+		return 0;
+	int err = sendRange(sock, 0, batchCount);
+	batchCount = 0;
+	return err;
+}
+
+// Takes every datagram waiting on the socket into buf, and who sent it into addrs. Returns how
+// many.
+int recvAll(int &sock, char buf[][1024], int *lens, struct sockaddr_in *addrs){
+	if(batchIO){
+		struct mmsghdr msgs[MAX_BATCH];
+		struct iovec iovs[MAX_BATCH];
+		memset(msgs, 0, sizeof(msgs));
+		for(int i = 0; i < MAX_BATCH; i++){
+			iovs[i].iov_base = buf[i];
+			iovs[i].iov_len = 1024;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int n = recvmmsg(sock, msgs, MAX_BATCH, MSG_DONTWAIT, NULL);
+		if(n >= 0 || errno != ENOSYS){
+			for(int i = 0; i < n; i++)
+				lens[i] = msgs[i].msg_len;
+			return n > 0 ? n : 0;
+		}
+		batchIO = 0; // No recvmmsg, use recvfrom from here on.
+	}
+	int count = 0;
+	while(count < MAX_BATCH){
+		socklen_t addrLen = sizeof(addrs[count]);
+		int n = recvfrom(sock, buf[count], 1024, MSG_DONTWAIT, (struct sockaddr *)&addrs[count], &addrLen);
+		if(n < 0)
+			break;
+		lens[count++] = n;
+	}
+	return count;
+}
+
+// Function to send the file not Found packet. If it is lost the client asks again, and the 0x04
+// it answers with needs nothing done, so there is no waiting for it.
+void nullFile(int &sock, struct sockaddr_in &clientAddr){
+	char toSend[9];
+	char *sendCurrent = toSend;
+	ratsHead sendHdr;
+		
+	sendHdr.opCode = 0x03;
+	memcpy(sendCurrent, &sendHdr.opCode, 1);
+	sendCurrent++;
+		
+	sendHdr.seqNum = 0;
+	memcpy(sendCurrent, &sendHdr.seqNum, 4);
+	sendCurrent += 4;
+
+	sendHdr.size = 0;
+	memcpy(sendCurrent, &sendHdr.size, 2);
+	sendCurrent += 2;
+
+	sendHdr.check = 0;
+	memcpy(sendCurrent, &sendHdr.check, 2);
+
+	auto check = generateChecksum(toSend, 9);
+	sendHdr.check = check;
+	memcpy(sendCurrent, &sendHdr.check, 2);
+	printf("Sending file not found\n");
+	int err = sendto(sock, toSend, 9, 0, (struct sockaddr *)&clientAddr, sizeof(clientAddr));
+	if(err < 0){
+		perror("Error Sending error to client\n");
+	}
+	return;
+}
+
+// XXH64 hash, used for the Merkle tree over the data (see below).
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input){
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t val){
+	acc ^= xxhRound(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xxh64(const unsigned char *p, size_t len, uint64_t seed){
+	const unsigned char *end = p + len;
+	uint64_t h;
+	if(len >= 32){
+		uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+		uint64_t v2 = seed + PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME64_1;
+		uint64_t lane;
+		do{
+			memcpy(&lane, p, 8); v1 = xxhRound(v1, lane); p += 8;
+			memcpy(&lane, p, 8); v2 = xxhRound(v2, lane); p += 8;
+			memcpy(&lane, p, 8); v3 = xxhRound(v3, lane); p += 8;
+			memcpy(&lane, p, 8); v4 = xxhRound(v4, lane); p += 8;
+		}while(p + 32 <= end);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxhMerge(h, v1);
+		h = xxhMerge(h, v2);
+		h = xxhMerge(h, v3);
+		h = xxhMerge(h, v4);
+	}
+	else
+		h = seed + PRIME64_5;
+	h += len;
+	while(p + 8 <= end){
+		uint64_t lane;
+		memcpy(&lane, p, 8);
+		h ^= xxhRound(0, lane);
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if(p + 4 <= end){
+		uint32_t lane;
+		memcpy(&lane, p, 4);
+		h ^= (uint64_t)lane * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while(p < end){
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		p++;
+	}
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+// Merkle tree over the data stream, for the client to check what it wrote. The leaves are
+// LEAF_PACKETS packets' worth of data each, hashed with XXH64 as packets are read; a parent is the
+// XXH64 of its two children's hashes, an odd one out moves up as is. The root goes in the 0x05
+// (or 0x07), the leaves when the client asks for them.
+#define LEAF_PACKETS 16
+#define LEAF_BYTES (LEAF_PACKETS * 1015)
+uint64_t zeroLeaf; // Hash of a whole leaf of zeros, holes don't need hashing
+
+// Adds len bytes of the data stream (zeros if data is NULL) to the session's leaves.
+void leafAdd(struct session &s, const unsigned char *data, off_t len){
+	while(len > 0){
+		if(data == NULL && s.leafBuf.empty() && len >= LEAF_BYTES){
+			s.leafHashes.push_back(zeroLeaf);
+			len -= LEAF_BYTES;
+			continue;
+		}
+		size_t part = min(len, (off_t)(LEAF_BYTES - s.leafBuf.size()));
+		if(data != NULL){
+			s.leafBuf.insert(s.leafBuf.end(), data, data + part);
+			data += part;
+		}
+		else
+			s.leafBuf.resize(s.leafBuf.size() + part, 0);
+		len -= part;
+		if(s.leafBuf.size() == LEAF_BYTES){
+			s.leafHashes.push_back(xxh64(s.leafBuf.data(), s.leafBuf.size(), 0));
+			s.leafBuf.clear();
+		}
+	}
+}
+
+// Root of the Merkle tree over the session's leaves, hashing the last partial leaf first.
+uint64_t leafFinish(struct session &s){
+	if(!s.leafBuf.empty()){
+		s.leafHashes.push_back(xxh64(s.leafBuf.data(), s.leafBuf.size(), 0));
+		s.leafBuf.clear();
+	}
+	vector<uint64_t> level = s.leafHashes;
+	if(level.empty())
+		return xxh64(NULL, 0, 0);
+	while(level.size() > 1){
+		vector<uint64_t> up;
+		for(size_t i = 0; i < level.size(); i += 2){
+			if(i + 1 == level.size()){
+				up.push_back(level[i]);
+				break;
+			}
+			unsigned char pair[16];
+			memcpy(pair, &level[i], 8);
+			memcpy(pair + 8, &level[i + 1], 8);
+			up.push_back(xxh64(pair, 16, 0));
+		}
+		level = up;
+	}
+	return level[0];
+}
+
+// Queues a packet read from the file, hashing its data on the way. Packets are queued in
+// sequence order, so this is the data stream in order.
+void queueRead(struct session &s, struct packetData &data){
+	if(data.zeroRun > 0)
+		leafAdd(s, NULL, (off_t)data.zeroRun * 1015);
+	else
+		leafAdd(s, data.data, data.dataSize);
+	s.packets.push_back(data);
+}
+
+// Sends leaf hashes from first on, as many as fit, in a 0x0A.
+void sendManifest(int &sock, struct session &s, uint32_t first){
+	char toSend[9 + 1008];
+	ratsHead sendHdr;
+	size_t count = first < s.leafHashes.size() ? min(s.leafHashes.size() - first, (size_t)126) : 0;
+	sendHdr.opCode = 0x0A;
+	sendHdr.seqNum = first;
+	sendHdr.size = count * 8;
+	sendHdr.check = 0;
+	memcpy(toSend, &sendHdr.opCode, 1);
+	memcpy(toSend + 1, &sendHdr.seqNum, 4);
+	memcpy(toSend + 5, &sendHdr.size, 2);
+	memcpy(toSend + 7, &sendHdr.check, 2);
+	if(count > 0)
+		memcpy(toSend + 9, &s.leafHashes[first], count * 8);
+	sendHdr.check = generateChecksum(toSend, 9 + sendHdr.size);
+	memcpy(toSend + 7, &sendHdr.check, 2);
+	if(verbose)
+		printf("Sending manifest from leaf %u\n", first);
+	if(sendto(sock, toSend, 9 + sendHdr.size, 0, (struct sockaddr *)&s.addr, sizeof(s.addr)) < 0)
+		perror("Error sending manifest\n");
+}
+
+/*
+ *	Index of the served directory. Built at startup and kept current with inotify, so requests
+ *	are answered with one hash lookup instead of stat-ing whatever path the client sent. Only
+ *	regular files under the root are in it (symlinks are not followed), so a path that is not
+ *	in the index is "not found", which also keeps clients inside the root.
+*/
+struct fileInfo{
+	off_t size;
+	struct timespec mtime;
+	uint32_t chunks;
+	bool stale; // Being written to, look at the file itself until it is closed
+};
+unordered_map<string, struct fileInfo> fileIndex;
+mutex indexLock;
+int rootFd = -1;
+int inotifyFd = -1;
+map<int, string> watchDirs; // inotify watch -> directory it watches, relative to the root
+
+// Turns a client path into the index key: relative to the root, no "." or empty parts. Returns
+// an empty string for paths with ".." in them, those are never in the index.
+string normalizePath(const char *path){
+	string out;
+	string part;
+	for(const char *c = path; ; c++){
+		if(*c == '/' || *c == '\0'){
+			if(part == "..")
+				return "";
+			if(!part.empty() && part != "."){
+				if(!out.empty())
+					out += '/';
+				out += part;
+			}
+			part.clear();
+			if(*c == '\0')
+				break;
+		}
+		else
+			part += *c;
+	}
+	return out;
+}
+
+// Opens rel (relative to the root) without leaving the root: no part of the path may be ".." or a
+// symlink, so a directory swapped for one after it was indexed doesn't lead anywhere else.
+// Kernels without openat2 get the same by opening one directory at a time with O_NOFOLLOW.
+int openBeneath(const string &rel, int flags){
+	const char *path = rel.empty() ? "." : rel.c_str();
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_NOFOLLOW | O_CLOEXEC;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+	int fd = syscall(SYS_openat2, rootFd, path, &how, sizeof(how));
+	if(fd >= 0 || errno != ENOSYS)
+		return fd;
+
+	int dir = rootFd;
+	const char *part = path;
+	const char *slash;
+	while((slash = strchr(part, '/')) != NULL){
+		string name(part, slash - part);
+		int next = name == ".." ? -1 : openat(dir, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if(dir != rootFd)
+			close(dir);
+		if(next < 0)
+			return -1;
+		dir = next;
+		part = slash + 1;
+	}
+	fd = strcmp(part, "..") == 0 ? -1 : openat(dir, part, flags | O_NOFOLLOW | O_CLOEXEC);
+	if(dir != rootFd)
+		close(dir);
+	return fd;
+}
+
+// stat of rel, through openBeneath. Returns false if it can't be reached.
+bool statBeneath(const string &rel, struct stat &status){
+	int fd = openBeneath(rel, O_PATH);
+	if(fd < 0)
+		return false;
+	bool good = fstat(fd, &status) == 0;
+	close(fd);
+	return good;
+}
+
+// Fills in info for the file at rel. Returns false if it is not a regular file.
+bool indexFile(const string &rel, struct fileInfo &info){
+	struct stat status;
+	if(!statBeneath(rel, status) || !S_ISREG(status.st_mode))
+		return false;
+	info.size = status.st_size;
+	info.mtime = status.st_mtim;
+	info.chunks = ceil(status.st_size / 1015.0);
+	info.stale = false;
+	return true;
+}
+
+// Walks the directory rel (relative to the root), adding an inotify watch on every directory
+// and listing every file in files.
+void walkDir(const string &rel, vector<string> &files){
+	int fd = openBeneath(rel, O_RDONLY | O_DIRECTORY);
+	if(fd < 0)
+		return;
+	if(inotifyFd >= 0){
+		// Watch the directory that was opened, not whatever the path leads to by now.
+		char self[64];
+		snprintf(self, sizeof(self), "/proc/self/fd/%d", fd);
+		int wd = inotify_add_watch(inotifyFd, self, IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+		if(wd >= 0)
+			watchDirs[wd] = rel;
+	}
+	DIR *dir = fdopendir(fd);
+	if(dir == NULL){
+		close(fd);
+		return;
+	}
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL){
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		string path = rel.empty() ? entry->d_name : rel + "/" + entry->d_name;
+		if(entry->d_type == DT_DIR)
+			walkDir(path, files);
+		else if(entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN)
+			files.push_back(path);
+	}
+	closedir(dir);
+}
+
+// Indexes files in parallel, one thread per core, and adds them to the index. With replace set
+// they take the place of whatever was in it.
+void indexFiles(vector<string> &files, bool replace = false){
+	vector<struct fileInfo> infos(files.size());
+	vector<char> good(files.size(), 0);
+	atomic<size_t> next(0);
+	unsigned workers = max(1u, thread::hardware_concurrency());
+	vector<thread> threads;
+	for(unsigned t = 0; t < workers; t++){
+		threads.push_back(thread([&](){
+			for(size_t i = next++; i < files.size(); i = next++)
+				good[i] = indexFile(files[i], infos[i]);
+		}));
+	}
+	for(auto &t : threads)
+		t.join();
+	lock_guard<mutex> guard(indexLock);
+	if(replace)
+		fileIndex.clear();
+	for(size_t i = 0; i < files.size(); i++){
+		if(good[i])
+			fileIndex[files[i]] = infos[i];
+	}
+}
+
+// Walks the whole root and replaces the index with what is there now. Watches on directories
+// that are still there keep their numbers, inotify hands back the same one when it is added again.
+void indexRoot(){
+	watchDirs.clear();
+	vector<string> files;
+	walkDir("", files);
+	indexFiles(files, true);
+}
+
+// Stops watching the directory rel and everything under it, it has gone or moved away. Left in,
+// the watches would keep reporting changes under rel's old path.
+void dropWatches(const string &rel){
+	string prefix = rel + "/";
+	for(auto it = watchDirs.begin(); it != watchDirs.end(); ){
+		if(it->second == rel || it->second.compare(0, prefix.size(), prefix) == 0){
+			inotify_rm_watch(inotifyFd, it->first);
+			it = watchDirs.erase(it);
+		}
+		else
+			++it;
+	}
+}
+
+// Keeps the index current. Runs on its own thread, blocked on the inotify descriptor.
+void watchIndex(){
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while(1){
+		int len = read(inotifyFd, buf, sizeof(buf));
+		if(len <= 0){
+			if(len < 0 && errno == EINTR)
+				continue;
+			perror("inotify read failed, index will not be updated\n");
+			return;
+		}
+		for(char *at = buf; at < buf + len; at += sizeof(struct inotify_event) + ((struct inotify_event *)at)->len){
+			struct inotify_event *event = (struct inotify_event *)at;
+			if(event->mask & IN_Q_OVERFLOW){ // Events were lost, the index can't be trusted.
+				printf("inotify queue overflowed, indexing everything again\n");
+				indexRoot();
+				continue;
+			}
+			if(event->mask & IN_IGNORED){ // Watch is gone (its directory was deleted, or dropWatches).
+				watchDirs.erase(event->wd);
+				continue;
+			}
+			if(event->len == 0 || watchDirs.count(event->wd) == 0)
+				continue;
+			string dir = watchDirs[event->wd];
+			string rel = dir.empty() ? event->name : dir + "/" + event->name;
+
+			if(event->mask & (IN_DELETE | IN_MOVED_FROM)){
+				if(event->mask & IN_ISDIR)
+					dropWatches(rel);
+				lock_guard<mutex> guard(indexLock);
+				fileIndex.erase(rel);
+				if(event->mask & IN_ISDIR){ // Everything under it goes too.
+					string prefix = rel + "/";
+					for(auto it = fileIndex.begin(); it != fileIndex.end(); ){
+						if(it->first.compare(0, prefix.size(), prefix) == 0)
+							it = fileIndex.erase(it);
+						else
+							++it;
+					}
+				}
+				continue;
+			}
+			if(event->mask & IN_ISDIR){
+				if(event->mask & (IN_CREATE | IN_MOVED_TO)){
+					vector<string> files;
+					walkDir(rel, files);
+					indexFiles(files);
+				}
+				continue;
+			}
+			if(event->mask & IN_MODIFY){
+				lock_guard<mutex> guard(indexLock);
+				auto it = fileIndex.find(rel);
+				if(it != fileIndex.end())
+					it->second.stale = true;
+				continue;
+			}
+			// Created, closed after writing, moved in, or attributes changed: index it again.
+			struct fileInfo info;
+			bool good = indexFile(rel, info);
+			lock_guard<mutex> guard(indexLock);
+			if(good)
+				fileIndex[rel] = info;
+			else
+				fileIndex.erase(rel);
+		}
+	}
+}
+
+// Builds the index of root and starts the thread that keeps it current. Returns -1 if root
+// can't be opened.
+int buildIndex(const char *root){
+	rootFd = open(root, O_RDONLY | O_DIRECTORY);
+	if(rootFd < 0)
+		return -1;
+	inotifyFd = inotify_init1(IN_CLOEXEC);
+	if(inotifyFd < 0)
+		perror("inotify not available, index will not be updated\n");
+	double start = nowSec();
+	indexRoot();
+	printf("Indexed %zu files in %.3f s\n", fileIndex.size(), nowSec() - start);
+	if(inotifyFd >= 0)
+		thread(watchIndex).detach();
+	return 0;
+}
+
+// Looks path up in the index. Returns false if it isn't there. size is the file's size.
+bool lookupFile(const string &rel, off_t &size){
+	if(rel.empty())
+		return false;
+	{
+		lock_guard<mutex> guard(indexLock);
+		auto it = fileIndex.find(rel);
+		if(it == fileIndex.end())
+			return false;
+		if(!it->second.stale){
+			size = it->second.size;
+			return true;
+		}
+	}
+	// Still being written, so the index can't be trusted for its size.
+	struct stat status;
+	if(!statBeneath(rel, status) || !S_ISREG(status.st_mode))
+		return false;
+	size = status.st_size;
+	return true;
+}
+
+bool rangeCompare(struct byteRange first, struct byteRange second){
+	return first.offset < second.offset;
+}
+
+// Puts ranges in order, merges ones that overlap or touch, and cuts them off at size. The client
+// does the same (without knowing the size), so both agree on where each packet's bytes go.
+void normalizeRanges(vector<struct byteRange> &list, off_t size){
+	sort(list.begin(), list.end(), rangeCompare);
+	vector<struct byteRange> merged;
+	for(auto &e : list){
+		if(e.offset < 0 || e.length <= 0 || e.offset >= size)
+			continue;
+		off_t end = (e.length > size - e.offset) ? size : e.offset + e.length;
+		if(!merged.empty() && e.offset <= merged.back().offset + merged.back().length)
+			merged.back().length = max(merged.back().length, end - merged.back().offset);
+		else
+			merged.push_back({e.offset, end - e.offset});
+	}
+	list = merged;
+}
+
+// File offset the next chunk starts at. Moves on to the next range if this one is used up.
+off_t readPos(struct session &s){
+	while(s.rangeLeft == 0 && s.curRange + 1 < s.ranges.size()){
+		s.curRange++;
+		s.rangeLeft = s.ranges[s.curRange].length;
+		fseeko(s.file, s.ranges[s.curRange].offset, SEEK_SET);
+	}
+	if(s.ranges.empty())
+		return 0;
+	return s.ranges[s.curRange].offset + s.ranges[s.curRange].length - s.rangeLeft;
+}
+
+// Reads the next chunk of the data stream into data, across ranges if need be. If the file has
+// shrunk since the request the session is marked failed, data then only holds what was read.
+void readChunk(struct session &s, struct packetData &data){
+	size_t want = min(s.fileSize, (size_t)1015);
+	size_t got = 0;
+	while(got < want){
+		readPos(s);
+		size_t part = min((off_t)(want - got), s.rangeLeft);
+		if(part == 0)
+			break;
+		size_t read = fread(data.data + got, 1, part, s.file);
+		s.rangeLeft -= read;
+		got += read;
+		if(read < part){
+			s.failed = true;
+			break;
+		}
+	}
+	data.dataSize = got;
+	s.fileSize -= got;
+	data.zeroRun = 0;
+}
+
+// True if the chunk is all zeros. Comparing the chunk against itself shifted by a byte lets
+// memcmp's vectorized loop do the work.
+bool isZero(struct packetData &data){
+	return data.dataSize > 0 && data.data[0] == 0 && memcmp(data.data, data.data + 1, data.dataSize - 1) == 0;
+}
+
+// Offset of the first hole at or after off, or the file size if there are no more.
+off_t nextHole(FILE *file, off_t off, off_t size){
+	off_t hole = lseek(fileno(file), off, SEEK_HOLE);
+	return hole < 0 ? size : hole;
+}
+
+// Drops what has been ACKed, then reads ahead far enough to cover the whole window. Holes are
+// found with SEEK_HOLE/SEEK_DATA on the stream's descriptor; that moves its offset, so the
+// stream is always put back with fseeko afterwards.
+void readAhead(struct session &s){
+	while(!s.packets.empty() && s.packets.front().seq + (int)max(s.packets.front().zeroRun, (uint32_t)1) <= s.startWin)
+		s.packets.pop_front();
+	while(s.nextRead <= s.endWin && s.nextRead <= s.maxWin){
+		if(s.nextRead > s.lastData){ // All the data is read, the 0x07 carries the root.
+			struct packetData last;
+			uint64_t root = leafFinish(s);
+			memcpy(last.data, &root, 8);
+			last.dataSize = 8;
+			last.seq = s.nextRead;
+			last.zeroRun = 0;
+			s.packets.push_back(last);
+			s.nextRead++;
+			continue;
+		}
+		off_t off = readPos(s);
+		// Zero runs never take in the last packet, so it is always written and the client's
+		// file comes out the right size.
+		int room = min(s.lastData - s.nextRead, MAX_ZERO_RUN);
+
+		// In a hole: everything up to the next data is zeros, no need to read it.
+		if(off >= s.holeStart){
+			off_t dataAt = lseek(fileno(s.file), off, SEEK_DATA);
+			if(dataAt < 0)
+				dataAt = s.fileLen;
+			int run = min((off_t)room, min(dataAt - off, s.rangeLeft) / 1015);
+			if(off + (off_t)(run + 1) * 1015 > dataAt) // Hole ends within the next chunk.
+				s.holeStart = nextHole(s.file, dataAt, s.fileLen);
+			fseeko(s.file, off + (off_t)run * 1015, SEEK_SET);
+			s.rangeLeft -= (off_t)run * 1015;
+			if(run > 0){
+				struct packetData zeros;
+				zeros.dataSize = 4;
+				zeros.seq = s.nextRead;
+				zeros.zeroRun = run;
+				queueRead(s, zeros);
+				s.fileSize -= (size_t)run * 1015;
+				s.nextRead += run;
+				continue;
+			}
+		}
+
+		struct packetData data;
+		readChunk(s, data);
+		if(s.failed)
+			break;
+		data.seq = s.nextRead;
+		if(room > 0 && isZero(data)){
+			// Zeros written out in the file. Read on while they last (stopping at a hole, the
+			// check above deals with those) and send them as one zero range.
+			struct packetData next;
+			int run = 1;
+			bool haveNext = false;
+			while(run < room && readPos(s) < s.holeStart){
+				readChunk(s, next);
+				if(s.failed)
+					break;
+				if(!isZero(next)){
+					haveNext = true;
+					break;
+				}
+				run++;
+			}
+			data.dataSize = 4;
+			data.zeroRun = run;
+			queueRead(s, data);
+			s.nextRead += run;
+			if(haveNext){
+				next.seq = s.nextRead;
+				queueRead(s, next);
+				s.nextRead++;
+			}
+			continue;
+		}
+		queueRead(s, data);
+		s.nextRead++;
+	}
+	if(s.failed) // Run the timer out now, sessionTimers ends it.
+		s.timerAt = nowSec();
+}
+
+// Key for the sessions map.
+uint64_t sessionKey(struct sockaddr_in &addr){
+	return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+struct session *findSession(struct sockaddr_in &addr){
+	auto found = sessions.find(sessionKey(addr));
+	return found == sessions.end() ? NULL : found->second;
+}
+
+// Retransmission timeout: four times the smallest RTT, kept between 50ms and 1s.
+double sessionRto(struct session &s){
+	if(s.minRtt <= 0)
+		return 1;
+	return min(1.0, max(0.05, s.minRtt * 4));
+}
+
+// Ends a session, whatever state it is in.
+void endSession(struct session &s, const char *why){
+	printf("%s, ending session\n", why);
+	if(s.state == SESSION_QUEUED){
+		auto &q = queued[s.cls];
+		q.erase(find(q.begin(), q.end(), &s));
+	}
+	else{
+		auto &a = active[s.cls];
+		a.erase(find(a.begin(), a.end(), &s));
+		admitted--;
+		stats[s.cls].finished++;
+	}
+	if(s.file != NULL)
+		fclose(s.file);
+	sessions.erase(sessionKey(s.addr));
+	delete &s;
+}
+
+// Everything is ACKed. A small file is done, anything else gets the 0x05 with the root.
+void finishSending(int &sock, struct session &s){
+	if(s.fastPath){ // Client ACKed the 0x07, nothing more to say.
+		endSession(s, "Small file sent");
+		return;
+	}
+	uint64_t root = leafFinish(s);
+	uint32_t leaves = s.leafHashes.size();
+	char *sendCurrent = s.done;
+	ratsHead sendHdr;
+
+	sendHdr.opCode = 0x05;
+	memcpy(sendCurrent, &sendHdr.opCode, 1);
+	sendCurrent++;
+
+	sendHdr.seqNum = s.round;
+	memcpy(sendCurrent, &sendHdr.seqNum, 4);
+	sendCurrent += 4;
+
+	sendHdr.size = 12;
+	memcpy(sendCurrent, &sendHdr.size, 2);
+	sendCurrent += 2;
+
+	sendHdr.check = 0;
+	memcpy(sendCurrent, &sendHdr.check, 2);
+	memcpy(sendCurrent + 2, &root, 8);
+	memcpy(sendCurrent + 10, &leaves, 4);
+
+	auto check = generateChecksum(s.done, sizeof(s.done));
+	sendHdr.check = check;
+	memcpy(sendCurrent, &sendHdr.check, 2);
+
+	// Resent by sessionTimers until the client's 0x06 comes, its manifest requests are answered
+	// in between.
+	s.state = SESSION_DONE;
+	s.timeouts = 0;
+	s.timerAt = nowSec() + 1;
+	s.packets.clear();
+	printf("Sending file done packet\n");
+	int err = sendto(sock, s.done, sizeof(s.done), 0, (struct sockaddr *)&s.addr, sizeof(s.addr));
+	if(err < 0)
+		perror("Error Sending error to client\n");
+}
+
+// What the session may have in flight.
+int sessionWindow(struct session &s){
+	return max(1, min(s.cwnd, s.peerWin));
+}
+
+// acked more packets got ACKed: cwnd grows by that many below ssthresh, and by one a window above
+// it, up to congWin.
+void congestionAck(struct session &s, int acked){
+	if(s.cwnd < s.ssthresh)
+		s.cwnd += acked;
+	else{
+		s.cwndAcked += acked;
+		while(s.cwndAcked >= s.cwnd){
+			s.cwndAcked -= s.cwnd;
+			s.cwnd++;
+		}
+	}
+	s.cwnd = min(s.cwnd, congWin);
+}
+
+// A packet was lost: halve cwnd on a fast resend, down to one packet on a timeout. A fast resend
+// only cuts once for everything that was in flight when it last got cut.
+void congestionLoss(struct session &s, bool timeout){
+	if(!timeout && s.startWin <= s.recoverSeq)
+		return;
+	s.ssthresh = max(2, s.cwnd / 2);
+	s.cwnd = timeout ? 1 : s.ssthresh;
+	s.cwndAcked = 0;
+	s.recoverSeq = s.sentUpTo;
+}
+
+// checkRecieve handles a packet from the client of session s, other than a request.
 // buf is the packet data recieved, size is size of packet (counting checksum, opcode, and sequence)
 // returns op code as int.
-int checkRecieve(char *buf, int &size){
-	if(maxWin < endWin)
-		endWin = maxWin;
+int checkRecieve(int &sock, struct session &s, char *buf, int &size){
 	ratsHead recHdr;
 	char *current = buf;
 	memcpy(&recHdr.opCode, current, 1);
@@ -133,108 +1212,398 @@ int checkRecieve(char *buf, int &size){
 	current += 2;
 	memcpy(&recHdr.check, current, 2);
 	current += 2;
-	//Check Checksum. If invalid, drop. We implement reliability via lack of ACKS, so don't send an error.
-	if(checkChecksum(buf, size) == 0){
-		printf("Dropped packet: Bad checksum\n");
+
+	// Nothing has been sent to a queued session yet, whatever it says can wait.
+	if(s.state == SESSION_QUEUED)
 		return -1;
-	}
 
-	// If Error ACK, simply reset everything
-	if(recHdr.opCode == 0x04){
-		startWin = 0;
-		endWin = 4;
-		return 4;
-	}
-	// File is done ACK, reset everything, return.
+	// File is done ACK, that's the end of it. One left over from an earlier round is not.
 	if(recHdr.opCode == 0x06){
-		startWin = 0;
-		endWin = 4;
+		if(s.state == SESSION_DONE && recHdr.seqNum == s.round)
+			endSession(s, "File done");
 		return 6;
 	}
+	// Client wants leaf hashes: the ones read so far while sending, all of them once done.
+	if(recHdr.opCode == 0x0A){
+		sendManifest(sock, s, recHdr.seqNum);
+		if(s.state == SESSION_DONE){
+			s.timeouts = 0;
+			s.timerAt = nowSec() + 1;
+		}
+		return 10;
+	}
 
 	// If ACK, can update window.
-	if(recHdr.opCode == 0x02){
+	if(recHdr.opCode == 0x02 && s.state == SESSION_SENDING && size >= 13){
 		uint32_t seq;
 		memcpy(&seq, current, 4);
-		printf("Seq from ack was %d\n", seq);
-		acks.insert(seq);
+		if(verbose)
+			printf("Seq from ack was %d\n", seq);
+		if(recHdr.size >= 8){
+			uint32_t win;
+			memcpy(&win, current + 4, 4);
+			s.peerWin = (int)min(win, (uint32_t)1 << 20);
+		}
 
-		if(startWin > maxWin)
-			startWin = maxWin + 1;
+		if(s.startWin > s.maxWin)
+			s.startWin = s.maxWin + 1;
 
-		if(startWin < seq){
-			startWin = seq;
-			endWin = seq + 4;
+		if(seq == (uint32_t)s.startWin && s.startWin <= s.maxWin && s.lastResent != s.startWin){
+			s.resendSeq = s.startWin;
+			s.lastResent = s.startWin;
+			congestionLoss(s, false);
 		}
-		if(endWin > maxWin)
-			endWin = maxWin;
-	
-		if(startWin > maxWin)
-			doneSending = 1;
+		if((uint32_t)s.startWin < seq && seq <= (uint32_t)s.maxWin + 1){
+			congestionAck(s, seq - s.startWin);
+			s.startWin = seq;
+		}
+		s.endWin = s.startWin + sessionWindow(s) - 1;
+		if(s.endWin > s.maxWin)
+			s.endWin = s.maxWin;
 
-		printf("startWin %d endWin %d maxWin %d\n", startWin, endWin, maxWin);
+		if(verbose)
+			printf("startWin %d endWin %d maxWin %d peerWin %d cwnd %d\n", s.startWin, s.endWin, s.maxWin, s.peerWin, s.cwnd);
 
+		double now = nowSec();
+		// RTT sample: timed packet leaving to its ACK arriving.
+		if(s.sampleSeq >= 0 && s.startWin > s.sampleSeq){
+			double rtt = now - s.sampleSent;
+			if(rtt > 0 && (s.minRtt == 0 || rtt < s.minRtt))
+				s.minRtt = rtt;
+			s.sampledUpTo = s.sampleSeq;
+			s.sampleSeq = -1;
+		}
+		s.timeouts = 0;
+		s.timerAt = now + sessionRto(s);
+		if(s.startWin > s.maxWin){
+			finishSending(sock, s);
+			return 2;
+		}
+		readAhead(s);
 		return 2;
 	}
+	return recHdr.opCode;
+}
 
-	if(recHdr.opCode == 0x00){
-		startWin = 0;
-		endWin = 4;
-		return 0;
+// The packet the session sends next: the fast resend if there is one, otherwise the first one in
+// the window not in flight yet. NULL if there is none.
+struct packetData *nextPacket(struct session &s){
+	if(s.state != SESSION_SENDING || s.failed)
+		return NULL;
+	if(s.resendSeq >= 0){
+		int seq = s.resendSeq;
+		auto entry = partition_point(s.packets.begin(), s.packets.end(), [seq](const struct packetData &p){ return p.seq < seq; });
+		if(entry != s.packets.end() && entry->seq == seq && seq <= s.endWin)
+			return &*entry;
+		s.resendSeq = -1; // Not a packet of its own, nothing to resend.
 	}
+	int after = s.sentUpTo;
+	auto entry = partition_point(s.packets.begin(), s.packets.end(), [after](const struct packetData &p){ return p.seq <= after; });
+	if(entry == s.packets.end() || entry->seq > s.endWin)
+		return NULL;
+	return &*entry;
 }
 
-// Function to send the file not Found packet
-void nullFile(int &sock, struct sockaddr_in &clientAddr){
-	char toSend[9];
+// When the session's next packet may leave, as far as its pacing and rate limit go. Only
+// meaningful if it has one.
+double sessionDue(struct session &s, double now){
+	return max(s.nextDepart, bucketNext(s.bucket, now));
+}
+
+// Builds the session's next packet into the batch to leave at when (not before now). Returns
+// its size.
+int queueNext(struct session &s, double now){
+	struct packetData &entry = *nextPacket(s);
+	s.sentUpTo = max(s.sentUpTo, entry.seq + (int)max(entry.zeroRun, (uint32_t)1) - 1);
+	if(entry.seq == s.resendSeq)
+		s.resendSeq = -1;
+
+	char *toSend = batchBuf[batchCount];
 	char *sendCurrent = toSend;
 	ratsHead sendHdr;
-		
-	sendHdr.opCode = 0x03;
+
+	sendHdr.opCode = 0x01;
+	if(entry.zeroRun > 0)
+		sendHdr.opCode = 0x08;
+	else if(s.fastPath && entry.seq == s.maxWin)
+		sendHdr.opCode = 0x07;
 	memcpy(sendCurrent, &sendHdr.opCode, 1);
 	sendCurrent++;
-		
-	sendHdr.seqNum = 0;
+
+	sendHdr.seqNum = entry.seq;
 	memcpy(sendCurrent, &sendHdr.seqNum, 4);
 	sendCurrent += 4;
 
-	sendHdr.size = 0;
+	sendHdr.size = entry.dataSize;
 	memcpy(sendCurrent, &sendHdr.size, 2);
 	sendCurrent += 2;
 
 	sendHdr.check = 0;
 	memcpy(sendCurrent, &sendHdr.check, 2);
+	sendCurrent += 2;
+	if(entry.zeroRun > 0)
+		memcpy(sendCurrent, &entry.zeroRun, 4);
+	else
+		memcpy(sendCurrent, &entry.data, sendHdr.size);
 
-	auto check = generateChecksum(toSend, 9);
+	auto check = generateChecksum(toSend, 9 + sendHdr.size);
 	sendHdr.check = check;
+	sendCurrent -= 2;
 	memcpy(sendCurrent, &sendHdr.check, 2);
-	printf("Sending file not found\n");
-	int err = sendto(sock, toSend, 9, 0, (struct sockaddr *)&clientAddr, sizeof(clientAddr));
-	if(err < 0){
-		perror("Error Sending error to client\n");
+	if(verbose)
+		printf("Seq is %d\n", sendHdr.seqNum);
+
+	// Departure: no sooner than the pacing gap after the one before it (a window spread over
+	// half the RTT) and no sooner than both rate limits allow.
+	int size = 9 + sendHdr.size;
+	double when = max(now, sessionDue(s, now));
+	when = bucketTake(s.bucket, when, size);
+	when = bucketTake(serverBucket, when, size);
+	if(pacing != PACE_OFF && s.minRtt > 0)
+		s.nextDepart = when + s.minRtt / (2.0 * sessionWindow(s));
+	batchLen[batchCount] = size;
+	batchAddr[batchCount] = s.addr;
+	batchDepart[batchCount] = when;
+	batchCount++;
+
+	if(s.sampleSeq < 0 && s.sentUpTo > s.sampledUpTo){ // Time the newest packet, one sample at a time.
+		s.sampleSeq = s.sentUpTo;
+		s.sampleSent = when;
 	}
-	char buf[13]; // 13 bytes for error ACK (9 header, 4 data);
-	socklen_t addrLen = sizeof(clientAddr);
-	int recSize = recvfrom(sock, buf, 13, 0, (struct sockaddr *)&clientAddr, &addrLen);
-	if(errno == EAGAIN || errno == EWOULDBLOCK){
-		printf("Error sending, sending not found again\n");
-		int err = sendto(sock, toSend, 9, 0, (struct sockaddr *)&clientAddr, sizeof(clientAddr));
-		if(err < 0){
-			perror("Error Sending error to client\n");
-		}
-		char buf[13]; // 13 bytes for error ACK (9 header, 4 data);
-		socklen_t addrLen = sizeof(clientAddr);
-		int recSize = recvfrom(sock, buf, 13, 0, (struct sockaddr *)&clientAddr, &addrLen);
-	}
-	printf("Error response is %d bytes\n", recSize);
-	checkRecieve(buf, recSize);
-	return;
+	if(s.timerAt == 0)
+		s.timerAt = when + sessionRto(s);
+	stats[s.cls].bytes += size;
+	return size;
+}
+
+// Deficit round robin over class c's sessions, queueing packets due by soon until the batch is
+// full, the server's rate is used up, nobody in the class has anything ready or budget bytes are
+// queued. Returns the bytes queued.
+long serveClass(int c, double now, double soon, long budget){
+	auto &ring = active[c];
+	long sent = 0;
+	size_t idle = 0; // Sessions in a row with nothing ready
+	while(batchCount < MAX_BATCH && sent < budget && idle < ring.size() && bucketNext(serverBucket, now) <= soon){
+		struct session &s = *ring.front();
+		if(nextPacket(s) == NULL || sessionDue(s, now) > soon){
+			s.deficit = 0;
+			s.inTurn = false;
+			ring.pop_front();
+			ring.push_back(&s);
+			idle++;
+			continue;
+		}
+		idle = 0;
+		if(!s.inTurn){
+			s.deficit += QUANTUM * s.weight;
+			s.inTurn = true;
+		}
+		while(batchCount < MAX_BATCH && sent < budget && nextPacket(s) != NULL && sessionDue(s, now) <= soon && bucketNext(serverBucket, now) <= soon){
+			int size = 9 + (nextPacket(s)->zeroRun > 0 ? 4 : nextPacket(s)->dataSize);
+			if(size > s.deficit)
+				break;
+			int queued = queueNext(s, now);
+			s.deficit -= queued;
+			sent += queued;
+		}
+		// Cut short by a full batch, the server's rate or the budget, the turn goes on next time.
+		if(batchCount == MAX_BATCH || bucketNext(serverBucket, now) > soon || sent >= budget)
+			break;
+		s.inTurn = false;
+		ring.pop_front();
+		ring.push_back(&s);
+	}
+	return sent;
+}
+
+// Fills the batch with packets that are due by now: floor credit first, then by class (see the
+// top of the sessions section). Returns how many were queued.
+int scheduleBatch(double now){
+	double soon = now + (pacing == PACE_TXTIME ? TXTIME_AHEAD : 0.00005);
+	int before = batchCount;
+	for(int c = 1; c < NUM_CLASSES && batchCount < MAX_BATCH; c++){
+		if(floorCredit[c] > 0)
+			floorCredit[c] -= serveClass(c, now, soon, floorCredit[c]);
+	}
+	for(int c = 0; c < NUM_CLASSES && batchCount < MAX_BATCH; c++){
+		long sent = serveClass(c, now, soon, LONG_MAX);
+		for(int lower = c + 1; lower < NUM_CLASSES; lower++){
+			if(!active[lower].empty())
+				floorCredit[lower] = min(floorCredit[lower] + sent * CLASS_FLOOR / 100, (long)MAX_FLOOR_CREDIT);
+		}
+		if(bucketNext(serverBucket, now) > soon) // Server rate used up, lower classes wait too.
+			break;
+	}
+	return batchCount - before;
+}
+
+// When the loop next has something to do for the sessions: a packet coming due or a timer
+// running out. Returns at most limit.
+double nextWake(double now, double limit){
+	double wake = limit;
+	for(int c = 0; c < NUM_CLASSES; c++){
+		for(auto s : active[c]){
+			if(s->timerAt > 0)
+				wake = min(wake, s->timerAt);
+			if(nextPacket(*s) != NULL)
+				wake = min(wake, max(sessionDue(*s, now), bucketNext(serverBucket, now)));
+		}
+	}
+	return wake;
+}
+
+// Runs out retransmission timers: resend everything from startWin (or the 0x05 again), or give up
+// on a client that stopped answering.
+void sessionTimers(int &sock, double now){
+	vector<struct session *> due;
+	for(int c = 0; c < NUM_CLASSES; c++){
+		for(auto s : active[c]){
+			if(s->timerAt > 0 && s->timerAt <= now)
+				due.push_back(s);
+		}
+	}
+	for(auto s : due){
+		if(s->failed){
+			nullFile(sock, s->addr);
+			endSession(*s, "File got shorter while sending");
+			continue;
+		}
+		s->timeouts++;
+		if(s->timeouts > (s->fastPath ? SMALL_FILE_RETRIES : MAX_TIMEOUTS)){
+			endSession(*s, "Client stopped answering");
+			continue;
+		}
+		if(s->state == SESSION_DONE){
+			printf("Sending file done packet\n");
+			if(sendto(sock, s->done, sizeof(s->done), 0, (struct sockaddr *)&s->addr, sizeof(s->addr)) < 0)
+				perror("Error Sending error to client\n");
+			s->timerAt = now + 1;
+			continue;
+		}
+		printf("ACK timeout, resending from %d\n", s->startWin);
+		congestionLoss(*s, true);
+		s->endWin = min(s->startWin + sessionWindow(*s) - 1, s->maxWin);
+		s->sentUpTo = s->startWin - 1;
+		s->sampleSeq = -1; // Can't tell which send an ACK would be for now.
+		s->timerAt = 0;
+	}
+}
+
+// Starts sending a queued session.
+void startSession(struct session &s, double now){
+	// Large stdio buffer so the per-packet freads turn into a few big read calls.
+	setvbuf(s.file, NULL, _IOFBF, 1 << 20);
+	s.state = SESSION_SENDING;
+	s.deficit = 0;
+	s.inTurn = false;
+	s.startWin = 0;
+	s.endWin = congWin - 1;
+	s.peerWin = congWin; // Until the first ACK says otherwise
+	s.cwnd = congWin;
+	s.ssthresh = congWin;
+	s.cwndAcked = 0;
+	s.recoverSeq = -1;
+	if(s.maxWin < s.endWin)
+		s.endWin = s.maxWin;
+	s.sentUpTo = -1;
+	s.resendSeq = -1;
+	s.lastResent = -1;
+	s.timeouts = 0;
+	s.failed = false;
+	s.timerAt = 0;
+	s.minRtt = 0;
+	s.sampleSeq = -1;
+	s.sampledUpTo = -1;
+	s.sampleSent = 0;
+	s.nextDepart = now;
+	bucketReset(s.bucket, transferRate);
+	s.leafBuf.reserve(LEAF_BYTES);
+	s.nextRead = 0;
+	s.curRange = 0;
+	s.rangeLeft = s.ranges.empty() ? 0 : s.ranges[0].length;
+	off_t firstByte = s.ranges.empty() ? 0 : s.ranges[0].offset;
+	s.holeStart = nextHole(s.file, firstByte, s.fileLen);
+	fseeko(s.file, firstByte, SEEK_SET);
 
+	admitted++;
+	active[s.cls].push_back(&s);
+	double delay = now - s.arrived;
+	stats[s.cls].sessions++;
+	stats[s.cls].delay += delay;
+	stats[s.cls].maxDelay = max(stats[s.cls].maxDelay, delay);
+	printf("Sending %zu bytes in %zu ranges to %s, class %d weight %d, queued %.1f ms\n", s.fileSize, s.ranges.size(), inet_ntoa(s.addr.sin_addr), s.cls, s.weight, delay * 1000);
+	readAhead(s);
 }
 
-// Filewrite sends the file in packets. Pass along the file path.
-// Tries to open the file to see if it exists
-void fileWrite(int &sock, struct sockaddr_in &clientAddr, char *buf){
+// Lets queued sessions in while the budgets have room, class 0 first. One session always gets in.
+// Files are only opened here, so queued sessions don't hold descriptors.
+void admitSessions(int &sock, double now){
+	for(int c = 0; c < NUM_CLASSES; c++){
+		while(!queued[c].empty()){
+			bool memory = (admitted + 1) * SESSION_MEMORY <= memoryBudget;
+			bool rate = serverBucket.rate <= 0 || (admitted + 1) * minRate <= serverBucket.rate;
+			if(admitted > 0 && !(memory && rate))
+				return;
+			struct session *s = queued[c].front();
+			int fd = openBeneath(s->path, O_RDONLY);
+			s->file = fd >= 0 ? fdopen(fd, "rb") : NULL;
+			if(s->file == NULL){ // Gone since the request.
+				if(fd >= 0)
+					close(fd);
+				nullFile(sock, s->addr);
+				endSession(*s, "Can't open file");
+				continue;
+			}
+			queued[c].pop_front();
+			startSession(*s, now);
+		}
+	}
+}
+
+// Class and weight for a new session: its subnet's rule, or by size. The client can only ask for
+// less than that, a lower priority class or a smaller weight. See the top of the sessions section.
+void classify(struct session &s, uint32_t asked){
+	s.cls = s.fileSize <= INTERACTIVE_BYTES ? 0 : 1;
+	s.weight = 1;
+	uint32_t ip = ntohl(s.addr.sin_addr.s_addr);
+	for(auto &r : classRules){
+		if((ip & r.mask) == r.net){
+			s.cls = r.cls;
+			s.weight = r.weight;
+			break;
+		}
+	}
+	int cls = (int)(asked & 0xFF) - 1;
+	int weight = (asked >> 8) & 0xFF;
+	if(cls >= 0)
+		s.cls = min(NUM_CLASSES - 1, max(s.cls, cls));
+	if(weight > 0)
+		s.weight = min(s.weight, weight);
+}
+
+// Reads RATS_CLASSES, "net/bits=class:weight,..." with the weight optional.
+void parseClassRules(char *spec){
+	for(char *part = strtok(spec, ", "); part != NULL; part = strtok(NULL, ", ")){
+		char *slash = strchr(part, '/');
+		char *equals = strchr(part, '=');
+		if(slash == NULL || equals == NULL || equals < slash){
+			printf("Bad RATS_CLASSES entry %s\n", part);
+			continue;
+		}
+		*slash = '\0';
+		struct classRule r;
+		int bits = atoi(slash + 1);
+		r.mask = bits <= 0 ? 0 : bits >= 32 ? 0xFFFFFFFF : ~((1u << (32 - bits)) - 1);
+		r.net = ntohl(inet_addr(part)) & r.mask;
+		r.cls = min(NUM_CLASSES - 1, max(0, atoi(equals + 1)));
+		char *colon = strchr(equals, ':');
+		r.weight = colon != NULL && atoi(colon + 1) > 0 ? atoi(colon + 1) : 1;
+		classRules.push_back(r);
+	}
+}
+
+// A new request: starts a session for it, unless it is a resend of one that is already going.
+void newRequest(int &sock, struct sockaddr_in &clientAddr, char *buf, int recLen){
 	ratsHead recHdr;
 	char *current = buf;
 	memcpy(&recHdr.opCode, current, 1);
@@ -245,179 +1614,265 @@ void fileWrite(int &sock, struct sockaddr_in &clientAddr, char *buf){
 	current += 2;
 	memcpy(&recHdr.check, current, 2);
 	current += 2;
+	if(recHdr.size > recLen - 9)
+		return;
 
-	char filep[ntohs(recHdr.size)];
-	memcpy(filep, current, ntohs(recHdr.size));
+	struct session *old = findSession(clientAddr);
+	if(old != NULL){
+		// The client asks again if nothing came back. Once it's done, the same address asking
+		// means another transfer (the 0x06 must have been lost).
+		if(old->state != SESSION_DONE && old->requestLen == recLen && memcmp(old->request, buf, recLen) == 0)
+			return;
+		endSession(*old, "New request from the same client");
+	}
 
-	FILE *file = fopen(filep, "rb");
-	if(file == NULL){
+	// Header fields are sent in host order like the rest of the packet. The path runs up to a
+	// zero byte or the end of the data, byte ranges can follow the zero byte.
+	size_t pathLen = strnlen(current, recHdr.size);
+	string filep(current, pathLen);
+
+	// Only files in the index get served. The file is opened once the session is let in.
+	string rel = normalizePath(filep.c_str());
+	off_t fileLen = 0;
+	if(!lookupFile(rel, fileLen)){
 		nullFile(sock, clientAddr);
 		return;
 	}
-	struct stat status;
-	stat(filep, &status);
-	maxWin = ceil(status.st_size / 1015.0) - 1;
-	fileSize = status.st_size;
-	if(maxWin < endWin)
-		endWin = maxWin;
-	int first, oldWin;
-	first = 1;
-	oldWin = startWin;
-
-	while(1){
-		if(startWin > maxWin){
-			oldWin = startWin;
-			doneSending = 1;
-		}
-		for(int i = 0; i < (startWin - oldWin); i++){
-			packets.pop_front();
-			struct packetData data;
-			if(fileSize < 1015){
-					fread(&data.data, 1, fileSize, file);
-					data.dataSize = fileSize;
-			}
-			else{
-				fread(&data.data, 1, 1015, file);
-				data.dataSize = 1015;
-			}
-			packets.push_back(data);
-			fileSize -= 1015;
-		}
-		oldWin = startWin;
-		if(first){ // First time sending, need to put in the starting packets.
-			first--;
-			for(int i = 0; i < endWin + 1; i++){
-				struct packetData data;
-				if(fileSize < 1015){
-					fread(&data.data, 1, fileSize, file);
-					data.dataSize = fileSize;
-				}
-				else{
-					fread(&data.data, 1, 1015, file);
-					data.dataSize = 1015;
-				}
-				packets.push_back(data);
-				fileSize -= 1015;
-			}
-		}
-
-		if(doneSending){ // Done, send packet saying so.
-			char toSend[9];
-			char *sendCurrent = toSend;
-			ratsHead sendHdr;
-		
-			sendHdr.opCode = 0x05;
-			memcpy(sendCurrent, &sendHdr.opCode, 1);
-			sendCurrent++;
-		
-			sendHdr.seqNum = startWin+1;
-			memcpy(sendCurrent, &sendHdr.seqNum, 4);
-			sendCurrent += 4;
-
-			sendHdr.size = 0;
-			memcpy(sendCurrent, &sendHdr.size, 2);
-			sendCurrent += 2;
-
-			sendHdr.check = 0;
-			memcpy(sendCurrent, &sendHdr.check, 2);
+	size_t waiting = 0;
+	for(int c = 0; c < NUM_CLASSES; c++)
+		waiting += queued[c].size();
+	if(waiting >= MAX_QUEUED){ // The client asks again later.
+		printf("Too many sessions queued, dropping request\n");
+		return;
+	}
 
-			auto check = generateChecksum(toSend, 9);
-			sendHdr.check = check;
-			memcpy(sendCurrent, &sendHdr.check, 2);
-			printf("Sending file done packet\n");
-			int err = sendto(sock, toSend, 9, 0, (struct sockaddr *)&clientAddr, sizeof(clientAddr));
-			if(err < 0){
-				perror("Error Sending error to client\n");
-				return;
-			}
-			char buf[9]; // 9 bytes for file done ACK (just header info);
-			socklen_t addrLen = sizeof(clientAddr);
-			int recSize = recvfrom(sock, buf, 9, 0, (struct sockaddr *)&clientAddr, &addrLen);
-			printf("File done response is %d bytes\n", recSize);
-			checkRecieve(buf, recSize);
-			// Timeout error. Go to recursive function that keeps sending/calling itself till it works.
-			if(errno == EAGAIN || errno == EWOULDBLOCK){
-				//timeout(sock, toSend, clientAddr, 9);
-			}
-			fclose(file);
-			return;
+	struct session *s = new struct session();
+	s->addr = clientAddr;
+	memcpy(s->request, buf, recLen);
+	s->requestLen = recLen;
+	s->path = rel;
+	s->file = NULL;
+	s->fileLen = fileLen;
+	if(pathLen < recHdr.size){
+		for(size_t at = pathLen + 1; at + 16 <= recHdr.size; at += 16){
+			uint64_t offset, length;
+			memcpy(&offset, current + at, 8);
+			memcpy(&length, current + at + 8, 8);
+			// Past what off_t holds just means "to the end of the file".
+			struct byteRange e = {(off_t)min(offset, (uint64_t)INT64_MAX), (off_t)min(length, (uint64_t)INT64_MAX)};
+			s->ranges.push_back(e);
 		}
+	}
+	else
+		s->ranges.push_back({0, fileLen});
+	normalizeRanges(s->ranges, fileLen);
+	s->fileSize = 0;
+	for(auto &e : s->ranges)
+		s->fileSize += e.length;
+	s->maxWin = ceil(s->fileSize / 1015.0) - 1;
+	// On the fast path the 0x07 with the root is one more packet after the data.
+	s->fastPath = s->maxWin < SMALL_FILE_PACKETS && s->maxWin + 1 < congWin;
+	s->lastData = s->maxWin;
+	if(s->fastPath)
+		s->maxWin++;
+	classify(*s, recHdr.seqNum);
+	s->round = recHdr.seqNum >> 16;
+	s->state = SESSION_QUEUED;
+	s->arrived = nowSec();
+	sessions[sessionKey(clientAddr)] = s;
+	queued[s->cls].push_back(s);
+	printf("Request for %s, %zu bytes, class %d\n", rel.c_str(), s->fileSize, s->cls);
+}
 
-		// Now have data packets to send, send them. Seq num is start win + whatever element it is.
-		for(int i = 0; i < packets.size(); i++){
-			char toSend[9 + packets[i].dataSize];
-			char *sendCurrent = toSend;
-			ratsHead sendHdr;
-		
-			sendHdr.opCode = 0x01;
-			memcpy(sendCurrent, &sendHdr.opCode, 1);
-			sendCurrent++;
-			
-			sendHdr.seqNum = startWin + i;
-			if((startWin + i) > endWin)
-				break;
-			memcpy(sendCurrent, &sendHdr.seqNum, 4);
-			sendCurrent += 4;
-	
-			sendHdr.size = packets[i].dataSize;
-			memcpy(sendCurrent, &sendHdr.size, 2);
-			sendCurrent += 2;	
-
-			sendHdr.check = 0;
-			memcpy(sendCurrent, &sendHdr.check, 2);		
-			sendCurrent += 2;
-			memcpy(sendCurrent, &packets[i].data, sendHdr.size);
-
-			char *temp = toSend;
-
-			auto check = generateChecksum(temp, 9 + sendHdr.size);
-			sendHdr.check = check;
-			sendCurrent -= 2;
-			memcpy(sendCurrent, &sendHdr.check, 2);
-
-			// Can send now
-			printf("Sending file data to client\n");
-			printf("Seq is %d\n", sendHdr. seqNum);
-			int err = sendto(sock, toSend, sizeof(toSend), 0, (struct sockaddr *)&clientAddr, sizeof(clientAddr));
-			if(err < 0){
-				perror("Error Sending data to client\n");
-				return;
-			}
+// Prints each class's numbers since the last time, if it is time and anything happened.
+void printStats(double now){
+	if(statsEvery <= 0 || now - lastStats < statsEvery)
+		return;
+	double span = now - lastStats;
+	lastStats = now;
+	for(int c = 0; c < NUM_CLASSES; c++){
+		struct classStats &st = stats[c];
+		if(st.bytes == 0 && st.sessions == 0 && active[c].empty() && queued[c].empty())
+			continue;
+		printf("Class %d: %.2f MB/s, %zu sending, %zu queued, %ld started, %ld finished, queue delay avg %.1f ms max %.1f ms\n", c, st.bytes / span / 1e6, active[c].size(), queued[c].size(), st.sessions, st.finished, st.sessions > 0 ? st.delay / st.sessions * 1000 : 0.0, st.maxDelay * 1000);
+		st = classStats();
+	}
+	fflush(stdout);
+}
 
-		}
+// Clients on the same host don't need UDP at all: they send the same request over a Unix socket
+// and get back the open file (the descriptor, passed with SCM_RIGHTS) to copy themselves.
+// RATS_LOCAL=off turns this off. The socket is in the abstract namespace, so there is no file
+// in /tmp for someone else to put there first, and it goes away with the server.
+#define LOCAL_SOCKET "rats-%d"
+int localSock = -1;
 
-		char buf[13]; // 13 bytes for ACK (9 for header, 4 for data (seq num));
-		socklen_t addrLen = sizeof(clientAddr);
-		int recSize = recvfrom(sock, buf, 13, 0, (struct sockaddr *)&clientAddr, &addrLen);
-		printf("ACK response is %d bytes\n", recSize);
-		checkRecieve(buf, recSize);
-		
-		// Since this function is called multiple times, and we only change window based on acks.
-		// Timeouts just mean we have to send packets again.
+// Local connections are non-blocking and polled with the UDP socket, so a local client that
+// never sends its request can't hold up the transfers. It gets LOCAL_TIMEOUT to send it.
+#define MAX_LOCAL 64
+#define LOCAL_TIMEOUT 1.0
+struct localConn{
+	int fd;
+	double opened;
+};
+vector<struct localConn> localConns;
 
+// Fills in the local socket's address for port. Returns its length: abstract names are not NUL
+// terminated, the length is what ends them.
+socklen_t localAddr(struct sockaddr_un &addr, int port){
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, LOCAL_SOCKET, port);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1);
+}
 
+int listenLocal(int port){
+	struct sockaddr_un addr;
+	socklen_t addrLen = localAddr(addr, port);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -1;
+	if(bind(fd, (struct sockaddr *)&addr, addrLen) < 0 || listen(fd, 16) < 0){
+		perror("Can't listen for local clients\n");
+		close(fd);
+		return -1;
 	}
+	return fd;
+}
 
+// Takes a new local connection. It is answered when its request comes in (see serveLocal).
+void acceptLocal(double now){
+	int conn = accept4(localSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(conn < 0)
+		return;
+	if(localConns.size() >= MAX_LOCAL){
+		close(conn);
+		return;
+	}
+	localConns.push_back({conn, now});
 }
 
-// Start of sending packets. Called to faciliate things.
-void recSend(int &sock, struct sockaddr_in &clientAddr){
+// Answers the request on a local connection: 0x09 with the file size and its descriptor, or
+// 0x03. Returns false if the request isn't there yet, otherwise the connection is closed.
+bool serveLocal(int conn){
 	char buf[1024];
-	socklen_t addrLen = sizeof(clientAddr);
+	int recLen = recv(conn, buf, sizeof(buf), 0);
+	if(recLen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return false;
+	ratsHead recHdr;
+	if(recLen < 9 || checkChecksum(buf, recLen) != 0 || buf[0] != 0x00){
+		close(conn);
+		return true;
+	}
+	memcpy(&recHdr.size, buf + 5, 2);
+	string filep(buf + 9, strnlen(buf + 9, min((int)recHdr.size, recLen - 9)));
+	string rel = normalizePath(filep.c_str());
+	off_t fileLen = 0;
+	int fd = -1;
+	struct stat status;
+	if(lookupFile(rel, fileLen))
+		fd = openBeneath(rel, O_RDONLY);
+	if(fd >= 0 && fstat(fd, &status) < 0){
+		close(fd);
+		fd = -1;
+	}
 
-	int recLen = recvfrom(sock, buf, 1024, 0, (struct sockaddr *)&clientAddr, &addrLen);
-	int checker = checkRecieve(buf, recLen);
-	if(checker == 0){ // Send along to fileWrite
-		fileWrite(sock, clientAddr, buf);
+	char toSend[17];
+	ratsHead sendHdr;
+	sendHdr.opCode = fd >= 0 ? 0x09 : 0x03;
+	sendHdr.seqNum = 0;
+	sendHdr.size = fd >= 0 ? 8 : 0;
+	sendHdr.check = 0;
+	memcpy(toSend, &sendHdr.opCode, 1);
+	memcpy(toSend + 1, &sendHdr.seqNum, 4);
+	memcpy(toSend + 5, &sendHdr.size, 2);
+	memcpy(toSend + 7, &sendHdr.check, 2);
+	if(fd >= 0){
+		uint64_t size = status.st_size;
+		memcpy(toSend + 9, &size, 8);
 	}
-	return;
+	sendHdr.check = generateChecksum(toSend, 9 + sendHdr.size);
+	memcpy(toSend + 7, &sendHdr.check, 2);
+
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov;
+	iov.iov_base = toSend;
+	iov.iov_len = 9 + sendHdr.size;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(fd >= 0){
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+		printf("Handing %s to a local client\n", rel.c_str());
+	}
+	else
+		printf("Sending file not found\n");
+	// The reply is small and nothing else was sent on the connection, so it fits in the buffer.
+	if(sendmsg(conn, &msg, MSG_NOSIGNAL) < 0)
+		perror("Error replying to local client\n");
+	if(fd >= 0)
+		close(fd);
+	close(conn);
+	return true;
 }
 
+// Serves the local connections poll found ready (revents, in localConns order) and drops the
+// ones that have waited too long.
+void serveLocals(struct pollfd *revents, double now){
+	vector<struct localConn> waiting;
+	for(size_t i = 0; i < localConns.size(); i++){
+		struct localConn &c = localConns[i];
+		if(revents[i].revents != 0 && serveLocal(c.fd))
+			continue;
+		if(now - c.opened > LOCAL_TIMEOUT){
+			close(c.fd);
+			continue;
+		}
+		waiting.push_back(c);
+	}
+	localConns = waiting;
+}
 
+// Takes every datagram waiting on the socket and hands it to its session. A request starts a new
+// session.
+void recSend(int &sock){
+	char buf[MAX_BATCH][1024];
+	int lens[MAX_BATCH];
+	struct sockaddr_in addrs[MAX_BATCH];
+	int count;
+	do{
+		count = recvAll(sock, buf, lens, addrs);
+		for(int i = 0; i < count; i++){
+			//Check Checksum. If invalid, drop. We implement reliability via lack of ACKS, so don't send an error.
+			if(checkChecksum(buf[i], lens[i]) != 0){
+				if(verbose)
+					printf("Dropped packet: Bad checksum\n");
+				continue;
+			}
+			if(buf[i][0] == 0x00){
+				newRequest(sock, addrs[i], buf[i], lens[i]);
+				continue;
+			}
+			struct session *s = findSession(addrs[i]);
+			if(s != NULL)
+				checkRecieve(sock, *s, buf[i], lens[i]);
+		}
+	}while(count == MAX_BATCH);
+}
 
 int main(){
-	startWin = 0; // Window starts at 0-4
-	endWin = 4;
+	char *io = getenv("RATS_IO");
+	if(io != NULL && strcmp(io, "blocking") == 0)
+		batchIO = 0;
+	verbose = getenv("RATS_VERBOSE") != NULL;
 	char port[16];
 	printf("Enter port: ");
 	fgets(port, 16, stdin);
@@ -427,6 +1882,16 @@ int main(){
 		return 1;
 	}
 
+	printf("Enter directory to serve (blank for the current directory): ");
+	char root[256];
+	if(fgets(root, 256, stdin) == NULL)
+		root[0] = '\0';
+	root[strcspn(root, "\n")] = '\0';
+	if(buildIndex(root[0] != '\0' ? root : ".") < 0){
+		perror("Can't open directory to serve\n");
+		return 1;
+	}
+
 	int sock = socket(AF_INET, SOCK_DGRAM, 0);
 
 	if(sock < 0){
@@ -435,7 +1900,7 @@ int main(){
 	}
 
 	// Setting up struct for bind. Using htonl to be portable and extra safe.
-	struct sockaddr_in serverAddr, clientAddr;
+	struct sockaddr_in serverAddr;
 	serverAddr.sin_family = AF_INET;
 	serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
 	serverAddr.sin_port = htons(atoi(port));
@@ -447,16 +1912,87 @@ int main(){
 		return 1;
 	}
 
-	struct timeval timeout;
-	timeout.tv_sec = 5;
-	timeout.tv_usec = 0;
+	char *pace = getenv("RATS_PACE");
+	if(pace != NULL && strcmp(pace, "off") == 0)
+		pacing = PACE_OFF;
+	if(pace != NULL && strcmp(pace, "txtime") == 0 && batchIO){
+#ifdef SO_TXTIME
+		struct sock_txtime txtime;
+		txtime.clockid = CLOCK_MONOTONIC;
+		txtime.flags = 0;
+		if(setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == 0)
+			pacing = PACE_TXTIME;
+		else
+			perror("SO_TXTIME not available, pacing with timers\n");
+#else
+		printf("SO_TXTIME not available, pacing with timers\n");
+#endif
+	}
+
+	char *window = getenv("RATS_WINDOW");
+	if(window != NULL && atoi(window) > 0)
+		congWin = atoi(window);
 
-	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0)
-		perror("Setsockopt failed\n");
+	char *rate = getenv("RATS_RATE");
+	if(rate != NULL)
+		transferRate = atof(rate);
+	rate = getenv("RATS_SERVER_RATE");
+	if(rate != NULL)
+		bucketReset(serverBucket, atof(rate));
 
-	// Recieving loop
+	char *local = getenv("RATS_LOCAL");
+	if(local == NULL || strcmp(local, "off") != 0)
+		localSock = listenLocal(atoi(port));
+
+	vector<unsigned char> zeros(LEAF_BYTES, 0);
+	zeroLeaf = xxh64(zeros.data(), LEAF_BYTES, 0);
+
+	char *classes = getenv("RATS_CLASSES");
+	if(classes != NULL)
+		parseClassRules(classes);
+	char *memory = getenv("RATS_MEMORY");
+	if(memory != NULL && atof(memory) > 0)
+		memoryBudget = (size_t)(atof(memory) * (1 << 20));
+	char *share = getenv("RATS_MIN_RATE");
+	if(share != NULL && atof(share) > 0)
+		minRate = atof(share);
+	char *every = getenv("RATS_STATS");
+	if(every != NULL)
+		statsEvery = atof(every);
+	lastStats = nowSec();
+
+	// Recieving loop. Waits for datagrams (or a local request) until the next packet is due or a
+	// timer runs out, then lets the sessions send whatever is due.
 	while(1){
-		recSend(sock, clientAddr);
+		double now = nowSec();
+		double wait = max(0.0, nextWake(now, now + 1) - now);
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		struct pollfd fds[2 + MAX_LOCAL];
+		fds[0].fd = sock;
+		fds[0].events = POLLIN;
+		fds[1].fd = localSock; // Ignored if -1
+		fds[1].events = POLLIN;
+		for(size_t i = 0; i < localConns.size(); i++){
+			fds[2 + i].fd = localConns[i].fd;
+			fds[2 + i].events = POLLIN;
+			fds[2 + i].revents = 0;
+		}
+		int ready = ppoll(fds, 2 + localConns.size(), &ts, NULL);
+		now = nowSec();
+		if(ready > 0 && (fds[0].revents & POLLIN))
+			recSend(sock);
+		serveLocals(fds + 2, now);
+		if(ready > 0 && (fds[1].revents & POLLIN))
+			acceptLocal(now);
+		sessionTimers(sock, now);
+		admitSessions(sock, now);
+		while(scheduleBatch(now) > 0){
+			if(flushBatch(sock) < 0)
+				perror("Error Sending data to client\n");
+		}
+		printStats(now);
 	}
 	
 
@@ -0,0 +1,131 @@
+#!/bin/bash
+# Loopback tests. Builds the server and client, serves a scratch directory on 127.0.0.1 and
+# fetches files of each kind from it, checking what arrives with cmp.
+# Usage: ./test.sh [port]  (default 9000; the clients bind free ports of their own)
+
+port=${1:-9000}
+src=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+server=
+trap '[ -n "$server" ] && kill $server 2> /dev/null; rm -rf "$work"' EXIT
+
+g++ -Wall -O2 -pthread -o "$work/server" "$src/server.cpp" || exit 1
+g++ -Wall -O2 -pthread -o "$work/client" "$src/client.cpp" || exit 1
+
+pass=0
+fail=0
+# check NAME COMMAND...: passes if the command does.
+check(){
+	local name=$1
+	shift
+	if "$@" > /dev/null 2>&1; then
+		echo "ok   $name"
+		pass=$((pass + 1))
+	else
+		echo "FAIL $name"
+		fail=$((fail + 1))
+	fi
+}
+
+# fetch PATH RANGES OUT [VAR=VALUE...]: runs the client over UDP with the environment given,
+# stdout into $work/stdout and everything else into $work/log.
+fetch(){
+	printf '%s\n127.0.0.1\n%s\n%s\n%s\n' "$port" "$1" "$2" "$3" |
+		env RATS_CLIENT_PORT=0 RATS_LOCAL=off "${@:4}" timeout 60 "$work/client" > "$work/stdout" 2> "$work/log"
+	cat "$work/stdout" >> "$work/log"
+}
+
+# part FILE OFFSET LENGTH: those bytes of the file.
+part(){
+	tail -c +$(($2 + 1)) "$1" | head -c "$3"
+}
+
+# Files of every kind the server treats differently.
+mkdir -p "$work/root/sub/dir" "$work/out"
+cd "$work/root"
+: > empty.bin
+head -c 3000 /dev/urandom > small.bin # Fits the one round trip fast path
+head -c 20000000 /dev/urandom > large.bin
+head -c 100000 /dev/urandom > sub/dir/nested.bin
+# Sparse, with data between the holes.
+truncate -s 40000000 sparse.bin
+for kb in 0 7000 25000 39995; do
+	head -c 5000 /dev/urandom | dd of=sparse.bin bs=1000 seek=$kb conv=notrunc status=none
+done
+# Zeros that are really on disk, between data.
+{ head -c 1000 /dev/urandom; head -c 3000000 /dev/zero; head -c 1000 /dev/urandom; } > zeros.bin
+ln -s /etc/passwd escape.bin
+
+printf '%s\n\n' "$port" | RATS_STATS=0 "$work/server" > "$work/server.log" 2>&1 &
+server=$!
+sleep 0.5
+
+# Whole files.
+for f in empty.bin small.bin large.bin sparse.bin zeros.bin sub/dir/nested.bin; do
+	fetch $f "" "$work/out/${f##*/}"
+	check "whole $f" cmp $f "$work/out/${f##*/}"
+done
+fetch small.bin "" "$work/out/small.bin"
+check "small file in one round trip" grep -q "Got last packet of small file" "$work/log"
+fetch large.bin "" "$work/out/large.bin"
+check "large file verified against the Merkle root" grep -q "Data verified" "$work/log"
+check "sparse copy keeps its holes" test $(du -k "$work/out/sparse.bin" | cut -f1) -lt 10000
+
+# Ranges, written in place and streamed. The last one runs past the end and gets cut there.
+ranges="1000:5000,5000000:100000,19999000:5000"
+rm -f "$work/out/ranged.bin"
+fetch large.bin "$ranges" "$work/out/ranged.bin"
+check "range 1000:5000 in place" cmp -i 1000:1000 -n 5000 large.bin "$work/out/ranged.bin"
+check "range 5000000:100000 in place" cmp -i 5000000:5000000 -n 100000 large.bin "$work/out/ranged.bin"
+check "range cut at the end of the file" cmp -i 19999000:19999000 large.bin "$work/out/ranged.bin"
+fetch large.bin "$ranges" -
+{ part large.bin 1000 5000; part large.bin 5000000 100000; part large.bin 19999000 1000; } > "$work/expected"
+check "ranges streamed to stdout" cmp "$work/expected" "$work/stdout"
+
+# More ranges than one request holds, the rest go in later rounds.
+ranges=$(for i in $(seq 0 79); do printf '%d:%d,' $((i * 100000)) $((10 + i)); done)
+fetch large.bin "${ranges%,}" -
+for i in $(seq 0 79); do part large.bin $((i * 100000)) $((10 + i)); done > "$work/expected"
+check "80 ranges over several requests" cmp "$work/expected" "$work/stdout"
+
+# Ranges across holes and zeros.
+fetch sparse.bin "6999000:3000,10000000:4096" -
+{ part sparse.bin 6999000 3000; part sparse.bin 10000000 4096; } > "$work/expected"
+check "ranges across holes" cmp "$work/expected" "$work/stdout"
+
+# Files the server must not serve, and one that appears while it runs.
+fetch missing.bin "" "$work/out/missing.bin"
+check "missing file is not found" grep -q "file does not exist" "$work/log"
+fetch escape.bin "" "$work/out/escape.bin"
+check "symlink out of the root is not served" grep -q "file does not exist" "$work/log"
+fetch ../escape.bin "" "$work/out/escape.bin"
+check "path out of the root is not served" grep -q "file does not exist" "$work/log"
+head -c 50000 /dev/urandom > new.bin
+sleep 0.5
+fetch new.bin "" "$work/out/new.bin"
+check "file created while serving" cmp new.bin "$work/out/new.bin"
+
+# Same host fast path, over the local socket.
+for f in large.bin sparse.bin; do
+	printf '%s\n127.0.0.1\n%s\n\n%s\n' "$port" $f "$work/out/local-$f" | timeout 60 "$work/client" > "$work/log" 2>&1
+	check "local $f" cmp $f "$work/out/local-$f"
+	check "local $f skipped UDP" grep -q "fetching locally" "$work/log"
+done
+rm -f "$work/out/local-ranged.bin"
+printf '%s\n127.0.0.1\nlarge.bin\n5000000:100000\n%s\n' "$port" "$work/out/local-ranged.bin" | timeout 60 "$work/client" > "$work/log" 2>&1
+check "local range" cmp -i 5000000:5000000 -n 100000 large.bin "$work/out/local-ranged.bin"
+
+# Concurrent sessions, in different classes.
+pids=
+for i in 0 1 2 3; do
+	printf '%s\n127.0.0.1\nlarge.bin\n\n%s\n' "$port" "$work/out/concurrent$i.bin" |
+		RATS_CLIENT_PORT=0 RATS_LOCAL=off RATS_CLASS=$((i % 3)) timeout 60 "$work/client" > "$work/log$i" 2>&1 &
+	pids="$pids $!"
+done
+wait $pids
+for i in 0 1 2 3; do
+	check "concurrent session $i" cmp large.bin "$work/out/concurrent$i.bin"
+done
+
+echo "$pass passed, $fail failed"
+[ $fail -eq 0 ]